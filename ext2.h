@@ -18,8 +18,15 @@
 #ifndef CSC369_EXT2_FS_H
 #define CSC369_EXT2_FS_H
 
-/* The ext2 block size used in the assignment. */
+/* The smallest ext2 block size, which s_log_block_size shifts left to give an image's block size */
 #define EXT2_BLOCK_SIZE 1024
+/* The largest block size the tools handle */
+#define EXT2_MAX_BLOCK_SIZE 4096
+
+/* Byte offset of the primary superblock from the start of the image */
+#define EXT2_SUPER_OFFSET 1024
+/* Value of s_magic for an ext2 filesystem */
+#define EXT2_SUPER_MAGIC 0xEF53
 
 /*
  * Structure of the super block
@@ -86,7 +93,7 @@ struct ext2_super_block {
 	 */
 	unsigned char  s_prealloc_blocks;     /* Nr of blocks to try to preallocate*/
 	unsigned char  s_prealloc_dir_blocks; /* Nr to preallocate for dirs */
-	unsigned short s_padding1;
+	unsigned short s_reserved_gdt_blocks; /* Per group table for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -96,14 +103,36 @@ struct ext2_super_block {
 	unsigned int   s_last_orphan;      /* start of list of inodes to delete */
 	unsigned int   s_hash_seed[4];     /* HTREE hash seed */
 	unsigned char  s_def_hash_version; /* Default hash version to use */
-	unsigned char  s_reserved_char_pad;
+	unsigned char  s_jnl_backup_type;  /* What s_jnl_blocks holds */
 	unsigned short s_reserved_word_pad;
 	unsigned int   s_default_mount_opts;
 	unsigned int   s_first_meta_bg; /* First metablock block group */
-	unsigned int   s_reserved[190]; /* Padding to the end of the block */
+	unsigned int   s_mkfs_time;     /* When the filesystem was created */
+	unsigned int   s_jnl_blocks[17]; /* Backup of the journal inode */
+	unsigned int   s_reserved[172]; /* Padding to the end of the block */
 };
 
 
+/*
+ * Feature flags of the superblock used by the journal
+ */
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004 /* Has an ext3 journal */
+#define EXT3_FEATURE_INCOMPAT_RECOVER   0x0004 /* Journal needs replaying */
+/*
+ * s_jnl_backup_type when s_jnl_blocks holds the journal inode's i_block, i_size_high and i_size
+ */
+#define EXT3_JNL_BACKUP_BLOCKS 1
+
+/*
+ * Feature flag for superblock backups only in groups 0, 1 and powers of 3, 5 and 7
+ */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+/*
+ * Feature flag for regular files of 2 GiB or more, which keep the high 32 bits of their size in i_dir_acl
+ */
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+
+
 /*
  * Structure of a blocks group descriptor
  */
@@ -121,6 +150,16 @@ struct ext2_group_desc
 };
 
 
+/*
+ * Constants relative to the data blocks
+ */
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS
+#define EXT2_DIND_BLOCK  (EXT2_IND_BLOCK + 1)
+#define EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK + 1)
+#define EXT2_N_BLOCKS    (EXT2_TIND_BLOCK + 1)
+
+
 /*
  * Structure of an inode on the disk
  */
@@ -144,12 +183,12 @@ struct ext2_inode {
 	unsigned int   i_flags;       /* File flags */
 	/* You should set it to 0. */
 	unsigned int   osd1;          /* OS dependent 1 */
-	unsigned int   i_block[15];   /* Pointers to blocks */
+	unsigned int   i_block[EXT2_N_BLOCKS]; /* Pointers to blocks */
 	/* You should use generation number 0 for the assignment. */
 	unsigned int   i_generation;  /* File version (for NFS) */
 	/* The following fields should be 0 for the assignment.  */
 	unsigned int   i_file_acl;    /* File ACL */
-	unsigned int   i_dir_acl;     /* Directory ACL */
+	unsigned int   i_dir_acl;     /* Directory ACL, high 32 bits of the size of a regular file */
 	unsigned int   i_faddr;       /* Fragment address */
 	unsigned int   extra[3];
 };
@@ -158,6 +197,7 @@ struct ext2_inode {
 /*
  * Type field for file mode
  */
+#define    EXT2_S_IFMT   0xF000    /* format mask */
 #define    EXT2_S_IFLNK  0xA000    /* symbolic link */
 #define    EXT2_S_IFREG  0x8000    /* regular file */
 #define    EXT2_S_IFDIR  0x4000    /* directory */
@@ -173,8 +213,12 @@ struct ext2_inode {
  */
 /* Root inode */
 #define    EXT2_ROOT_INO         2
+/* Journal inode */
+#define    EXT3_JOURNAL_INO      8
 /* First non-reserved inode for old ext2 filesystems */
 #define EXT2_GOOD_OLD_FIRST_INO 11
+/* Revision of old ext2 filesystems, which have no feature flags */
+#define EXT2_GOOD_OLD_REV 0
 
 
 /*
@@ -195,6 +239,12 @@ struct ext2_dir_entry {
 	char           name[];    /* File name, up to EXT2_NAME_LEN */
 };
 
+/* Smallest rec_len of an entry with a name of name_len bytes, which keeps the next entry 4-byte aligned */
+#define EXT2_DIR_REC_LEN(name_len) (((name_len) + 8 + 3) & ~3)
+
+/* i_flags bit of a directory with a hashed b-tree index hidden in its blocks */
+#define EXT2_INDEX_FL 0x00001000
+
 
 /*
  * Ext2 directory file types.  Only the low 3 bits are used.  The
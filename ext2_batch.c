@@ -0,0 +1,99 @@
+#define EXT2_BATCH
+#include "ext2_cp.c"
+#include "ext2_ln.c"
+#include "ext2_rm.c"
+#include "ext2_restore.c"
+
+/*
+ * Runs a stream of tool commands against one open image, one command per line:
+ *   cp [-r] <path on local system> <absolute path on virtual disk>
+ *   mkdir <absolute path on virtual disk>
+ *   ln [-s] <absolute path on virtual disk> <absolute path on virtual disk>
+ *   rm [-r] <absolute path on virtual disk>
+ *   restore <absolute path on virtual disk>
+ * Arguments are separated by whitespace, and a backslash makes the next character part of the argument.
+ * Blank lines and lines starting with # are skipped.
+ * The image stays mapped for the whole stream, so the directory indexes built by one command are reused
+ * by the next, and the image is written back once after the last command. On an image with a journal the
+ * commands are committed in batches, as many as the journal has room for
+ */
+
+#define MAX_ARGS 4
+
+/*
+ * Splits line into at most MAX_ARGS arguments in place, undoing backslash escapes
+ * Returns the number of arguments or -1 if there are too many
+ */
+static int split_args(char *line, char **args) {
+    int count = 0;
+    char *in = line;
+    while (1) {
+        while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r') in++;
+        if (*in == '\0') return count;
+        if (count == MAX_ARGS) return -1;
+        char *out = in;
+        args[count++] = out;
+        while (*in != '\0' && *in != ' ' && *in != '\t' && *in != '\n' && *in != '\r') {
+            if (*in == '\\' && in[1] != '\0') in++;
+            *out++ = *in++;
+        }
+        if (*in != '\0') in++;
+        *out = '\0';
+    }
+}
+
+/*
+ * Runs the command in args
+ * Returns 0 on success, an errno value if the command failed or -1 if it isn't a valid command
+ */
+static int run_command(char **args, int count) {
+    if (strcmp(args[0], "cp") == 0 && count == 3) return ext2_cp(args[1], args[2]);
+    if (strcmp(args[0], "cp") == 0 && count == 4 && strcmp(args[1], "-r") == 0) return ext2_cp_tree(args[2], args[3], NULL);
+    if (strcmp(args[0], "mkdir") == 0 && count == 2) return make_dir(args[1]);
+    if (strcmp(args[0], "ln") == 0 && count == 3) return ext2_ln(args[1], args[2], 0);
+    if (strcmp(args[0], "ln") == 0 && count == 4 && strcmp(args[1], "-s") == 0) return ext2_ln(args[2], args[3], 1);
+    if (strcmp(args[0], "rm") == 0 && count == 2) return ext2_rm(args[1]);
+    if (strcmp(args[0], "rm") == 0 && count == 3 && strcmp(args[1], "-r") == 0) return ext2_rm_tree(args[2]);
+    if (strcmp(args[0], "restore") == 0 && count == 2) return ext2_restore(args[1]);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <image file name> [command file, - or omitted for stdin]\n", argv[0]);
+        exit(1);
+    }
+    FILE *commands = stdin;
+    if (argc == 3 && strcmp(argv[2], "-") != 0) {
+        commands = fopen(argv[2], "r");
+        if (commands == NULL) {
+            perror(argv[2]);
+            exit(1);
+        }
+    }
+    open_image(argv[1]);
+
+    int first_err = 0; // errno of the first command that failed
+    char *line = NULL;
+    size_t line_cap = 0;
+    int line_no = 0;
+    while (getline(&line, &line_cap, commands) != -1) {
+        line_no++;
+        char *args[MAX_ARGS];
+        int count = split_args(line, args);
+        if (count == 0 || args[0][0] == '#') continue;
+        int err = count == -1 ? -1 : run_command(args, count);
+        if (err == -1) {
+            fprintf(stderr, "line %d: invalid command\n", line_no);
+            err = EINVAL;
+        } else if (err != 0) {
+            fprintf(stderr, "line %d: %s: %s\n", line_no, args[0], strerror(err));
+        }
+        if (first_err == 0) first_err = err;
+        if (journal_end_op()) journal_commit();
+    }
+    free(line);
+    if (commands != stdin) fclose(commands);
+    close_image();
+    return first_err;
+}
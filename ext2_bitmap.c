@@ -0,0 +1,159 @@
+#include <string.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Bitmap helpers shared by the inode and block bitmaps
+ * Bit n of a bitmap is bit n % 8 of byte n / 8, so on a little-endian machine bit n is also
+ * bit n % 64 of the 64 bit word at byte 8 * (n / 64), which lets the scans below look at
+ * 64 bits per step with __builtin_ctzll
+ */
+
+// Loads the (possibly unaligned) 64 bit word at p
+static inline uint64_t bitmap_load_word(const unsigned char *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// Returns the value of bit in bitmap
+static inline int bitmap_test(const unsigned char *bitmap, int bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+// Sets bit in bitmap
+static inline void bitmap_set(unsigned char *bitmap, int bit) {
+    bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+// Clears bit in bitmap
+static inline void bitmap_clear(unsigned char *bitmap, int bit) {
+    bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+// Sets bit in bitmap atomically and returns its previous value, so concurrent callers agree on who set it first
+static inline int bitmap_test_and_set_atomic(unsigned char *bitmap, int bit) {
+    unsigned char mask = 1 << (bit % 8);
+    return (__atomic_fetch_or(&bitmap[bit / 8], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/*
+ * Returns the number of whole bytes from bitmap + byte up to byte end that are all equal to skip
+ * Uses the widest vector unit the compiler was allowed to target and checks 32 bytes per step
+ */
+static inline int bitmap_skip_run(const unsigned char *bitmap, int byte, int end, unsigned char skip) {
+    int start = byte;
+#if defined(__AVX2__)
+    __m256i pattern = _mm256_set1_epi8((char)skip);
+    while (byte + 32 <= end) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bitmap + byte));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)) != -1) break;
+        byte += 32;
+    }
+#elif defined(__SSE2__)
+    __m128i pattern = _mm_set1_epi8((char)skip);
+    while (byte + 32 <= end) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(bitmap + byte));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(bitmap + byte + 16));
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(lo, pattern), _mm_cmpeq_epi8(hi, pattern));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) break;
+        byte += 32;
+    }
+#endif
+    return byte - start;
+}
+
+/*
+ * Returns the first bit in [start, nbits) of bitmap whose value is value, or -1 if there is none
+ */
+static inline int bitmap_scan(const unsigned char *bitmap, int start, int nbits, int value) {
+    uint64_t flip = value ? 0 : ~(uint64_t)0; // After flipping, the bits we look for are 1
+    int bit = start;
+    while (bit < nbits) {
+        // Skip whole runs of bytes holding none of the bits we look for
+        if (bit % 64 == 0) bit += 8 * bitmap_skip_run(bitmap, bit / 8, nbits / 8, value ? 0x00 : 0xFF);
+        if (bit >= nbits) break;
+        int word_start = bit & ~63;
+        uint64_t word;
+        if (word_start + 64 <= nbits) {
+            word = bitmap_load_word(bitmap + word_start / 8) ^ flip;
+        } else { // Don't read past the last byte of the bitmap
+            unsigned char tail[8] = {0};
+            memcpy(tail, bitmap + word_start / 8, (nbits - word_start + 7) / 8);
+            word = bitmap_load_word(tail) ^ flip;
+            word &= ~(uint64_t)0 >> (64 - (nbits - word_start));
+        }
+        word &= ~(uint64_t)0 << (bit - word_start);
+        if (word != 0) return word_start + __builtin_ctzll(word);
+        bit = word_start + 64;
+    }
+    return -1;
+}
+
+/*
+ * Returns the first 0 bit in [start, nbits) of bitmap or -1 if every bit is set
+ */
+int bitmap_find_zero(const unsigned char *bitmap, int start, int nbits) {
+    return bitmap_scan(bitmap, start, nbits, 0);
+}
+
+/*
+ * Returns the first 1 bit in [start, nbits) of bitmap or -1 if every bit is clear
+ */
+int bitmap_find_set(const unsigned char *bitmap, int start, int nbits) {
+    return bitmap_scan(bitmap, start, nbits, 1);
+}
+
+/*
+ * Sets the count bits of bitmap starting at bit start, filling whole bytes with memset
+ */
+void bitmap_set_range(unsigned char *bitmap, int start, int count) {
+    int bit = start;
+    int end = start + count;
+    for (; bit < end && bit % 8 != 0; bit++) bitmap_set(bitmap, bit);
+    if (end - bit >= 8) {
+        memset(bitmap + bit / 8, 0xFF, (end - bit) / 8);
+        bit += (end - bit) & ~7;
+    }
+    for (; bit < end; bit++) bitmap_set(bitmap, bit);
+}
+
+/*
+ * Clears the count bits of bitmap starting at bit start: the partial bytes at either end with one mask each
+ * and the whole bytes between them with memset
+ */
+void bitmap_clear_range(unsigned char *bitmap, int start, int count) {
+    int end = start + count;
+    if (count <= 0) return;
+    if (start / 8 == (end - 1) / 8) { // All in one byte
+        bitmap[start / 8] &= ~(((1 << count) - 1) << (start % 8));
+        return;
+    }
+    if (start % 8 != 0) {
+        bitmap[start / 8] &= (1 << (start % 8)) - 1;
+        start += 8 - start % 8;
+    }
+    memset(bitmap + start / 8, 0, (end - start) / 8);
+    if (end % 8 != 0) bitmap[end / 8] &= ~((1 << (end % 8)) - 1);
+}
+
+/*
+ * Returns the number of 0 bits in the first nbits bits of bitmap
+ */
+int bitmap_count_zero(const unsigned char *bitmap, int nbits) {
+    int set = 0;
+    int bit = 0;
+    for (; bit + 64 <= nbits; bit += 64) set += __builtin_popcountll(bitmap_load_word(bitmap + bit / 8));
+    for (; bit < nbits; bit++) set += bitmap_test(bitmap, bit);
+    return nbits - set;
+}
+
+/*
+ * Returns the length of the run of bits equal to bit start of bitmap, stopping at nbits
+ */
+int bitmap_run_length(const unsigned char *bitmap, int start, int nbits) {
+    int end = bitmap_scan(bitmap, start, nbits, !bitmap_test(bitmap, start));
+    return (end == -1 ? nbits : end) - start;
+}
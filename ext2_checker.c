@@ -1,171 +1,894 @@
+#include <getopt.h>
 #include "ext2_utils.c"
+#include "ext2_pool.c"
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
+/*
+ * The check runs in phases: per-group checks of the bitmaps and inode tables, then a walk of the
+ * directory tree from the root, then linear scans of the inode tables that map which inode owns each block
+ * to find bitmap bits nobody owns and blocks claimed twice, and that compare how many entries the walk found
+ * for each inode with the inode bitmap and the link counts. Ownership goes first so that the bitmap marks
+ * every owned block before the repairs that allocate, copying cross-linked blocks and making /lost+found,
+ * take any. Within a phase the checks only
+ * read the image and queue the repairs they find; the queue is applied on the main thread once the phase
+ * is over. That lets the checks run concurrently on a task pool with -j, and keeps the output the same
+ * however many threads run them
+ * With --incremental only what the dirty log (see ext2_dirty_log.c) says changed since the last check is
+ * checked: the logged groups, the entries of the logged directories and the logged inodes. Link counts,
+ * unattached inodes and block ownership need the whole image, so they are only checked by a full check
+ */
 
-// Simple singly linked list
-struct list {
-    struct list *next;
-    int val;
+// Dense visited bitmaps, so checking whether an inode or block was already seen is O(1)
+unsigned char *inode_seen; // Bit inode - 1 is set once inode has been checked
+unsigned char *block_seen; // Bit block is set once directory block block has been walked
+
+// Reference counts from the walk, NULL when it doesn't cover the whole tree
+int *link_refs; // link_refs[inode - 1] is the number of entries referring to inode, . and .. included
+unsigned char *inode_named; // Bit inode - 1 is set once an entry other than . or .. refers to inode
+int lost_found_ino; // /lost+found once an unattached inode needed it
+int reattaching; // Nonzero once find_unattached looks for the inodes to reattach rather than those to free
+
+/*
+ * Block ownership: a bit per block set once metadata or an inode claims it, and a sparse map holding only
+ * the blocks claimed more than once. A first scan can only tell that a block is claimed again, so a second
+ * scan, run only if there are any, collects every owner of the shared blocks
+ */
+unsigned char *block_owned; // Bit block is set once a block is claimed
+
+struct shared_block {
+    unsigned int block; // 0 for an unused slot
+    int owner_count;
+    int owner_cap;
+    int *owners;        // Inodes claiming the block, in ascending order once collected
 };
 
-struct list *inode_list; // Which inodes have already been fixed
-struct list *block_list; // Which blocks have been fixed
+pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+struct shared_block *shared; // Open addressing hash table keyed by block
+int shared_cap;
+int shared_count;
 
-int fix_entry(struct ext2_dir_entry *entry, unsigned file_type) {
-    int fixed = 0;
+struct task_pool *pool; // NULL when checking on a single thread
+int walk_subdirs = 1; // 0 if checking a directory's entries doesn't walk the directories below it
+
+enum fix_kind {
+    FIX_GROUP_FREE_INODES,
+    FIX_GROUP_FREE_BLOCKS,
+    FIX_DTIME,
+    FIX_ENTRY_TYPE,
+    FIX_INODE_BITMAP,
+    FIX_BLOCK_BITMAP,
+    FIX_UNATTACHED,
+    FIX_LINK_COUNT,
+    FIX_UNOWNED_BLOCKS,
+    FIX_OWNED_BLOCKS,
+    FIX_SHARED_BLOCKS,
+};
+
+// A repair found by a check, applied later by apply_fix
+struct fix {
+    enum fix_kind kind;
+    int inode; // Inode the fix is for, or group for the group counter and block ownership fixes
+    int value; // Real free count for the group counter fixes, file type for FIX_ENTRY_TYPE, links for FIX_LINK_COUNT
+    struct ext2_dir_entry *entry; // Entry to fix for FIX_ENTRY_TYPE
+    int seq; // Order the fix was queued in, to keep sorting stable
+};
+
+pthread_mutex_t fix_lock = PTHREAD_MUTEX_INITIALIZER;
+struct fix *fixes; // Serialized fix queue
+int fix_count;
+int fix_cap;
+
+void queue_fix(enum fix_kind kind, int inode, int value, struct ext2_dir_entry *entry) {
+    pthread_mutex_lock(&fix_lock);
+    if (fix_count == fix_cap) {
+        fix_cap = fix_cap ? 2 * fix_cap : 64;
+        fixes = realloc(fixes, fix_cap * sizeof(struct fix));
+        if (fixes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct fix f = { kind, inode, value, entry, fix_count };
+    fixes[fix_count++] = f;
+    pthread_mutex_unlock(&fix_lock);
+}
+
+// Runs fn(arg) on the pool, or right away when checking on a single thread
+void run_task(void (*fn)(void *), void *arg) {
+    if (pool != NULL) pool_submit(pool, fn, arg);
+    else fn(arg);
+}
+
+// for_each_inode_block callback counting blocks not marked in the block bitmap in *(int *)arg
+static void count_unmarked_cb(unsigned int block, void *arg) {
+    if (!block_is_allocated(block)) (*(int *)arg)++;
+}
+
+// for_each_inode_block callback marking block in use, counting fixes in *(int *)arg
+static void fix_block_cb(unsigned int block, void *arg) {
+    if (!block_is_allocated(block)) {
+        realloc_block(block);
+        (*(int *)arg)++;
+    }
+}
+
+/*
+ * Returns the inode of /lost+found, creating it if there is none, or -1 if it can't be had
+ */
+static int lost_found() {
+    if (lost_found_ino != 0) return lost_found_ino;
+    struct ext2_inode *root = inode_by_index(EXT2_ROOT_INO);
+    struct ext2_dir_entry *entry = dir_index_lookup(root, "lost+found", strlen("lost+found"));
+    if (entry == NULL) {
+        if (make_dir("/lost+found") != 0) return -1;
+        entry = dir_index_lookup(root, "lost+found", strlen("lost+found"));
+        // Count the new directory's entries: its own in /, its . and its .. to /
+        link_refs[entry->inode - 1] += 2;
+        bitmap_set(inode_named, entry->inode - 1);
+        link_refs[EXT2_ROOT_INO - 1]++;
+        inode_by_index(entry->inode)->i_mode |= 0700;
+        printf("Fixed: created /lost+found\n");
+    }
     struct ext2_inode *inode = inode_by_index(entry->inode);
+    if (inode == NULL || (inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) return -1;
+    lost_found_ino = entry->inode;
+    return lost_found_ino;
+}
+
+// Returns nonzero if inode, which no entry names, is to be freed rather than reattached
+static int unattached_is_dead(struct ext2_inode *inode) {
+    int type = inode->i_mode & EXT2_S_IFMT;
+    return type == 0 || (type != EXT2_S_IFDIR && inode->i_links_count == 0);
+}
+
+/*
+ * Repairs inode inode_index, which is in use but has no entry: frees it if it was deleted or has no type,
+ * otherwise links it into /lost+found as #<inode>, pointing its .. there if it is a directory
+ * Returns the number of inconsistencies repaired
+ */
+static int fix_unattached(int inode_index) {
+    struct ext2_inode *inode = inode_by_index(inode_index);
+    int type = inode->i_mode & EXT2_S_IFMT;
+    if (type == 0) { // Nothing to recover, and its block pointers can't be trusted
+        zero_inode_bitmap(inode_index);
+        adjust_free_inodes(inode_index, 1);
+        printf("Fixed: unattached inode [%d] without a type freed\n", inode_index);
+        return 1;
+    }
+    if (type != EXT2_S_IFDIR && inode->i_links_count == 0) {
+        clear_inode(inode_index);
+        printf("Fixed: unattached deleted inode [%d] freed\n", inode_index);
+        return 1;
+    }
+    int parent = lost_found();
+    char name[16];
+    sprintf(name, "#%d", inode_index);
+    struct ext2_dir_entry *entry = parent == -1 ? NULL : add_new_entry(name, inode_by_index(parent), 0);
+    if (entry == NULL) {
+        printf("Couldn't reattach unattached inode [%d] to /lost+found\n", inode_index);
+        return 0;
+    }
+    entry->inode = inode_index;
+    entry->file_type = type == EXT2_S_IFDIR ? EXT2_FT_DIR : type == EXT2_S_IFLNK ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+    link_refs[inode_index - 1]++;
+    if (type == EXT2_S_IFDIR) {
+        struct ext2_dir_entry *dotdot = dir_index_lookup(inode, "..", 2);
+        if (dotdot != NULL) {
+            if (inode_is_valid(dotdot->inode)) link_refs[dotdot->inode - 1]--;
+            dotdot->inode = parent;
+            link_refs[parent - 1]++;
+        }
+    }
+    printf("Fixed: unattached inode [%d] reattached to /lost+found\n", inode_index);
+    return 1;
+}
+
+// Returns the slot of block in shared, which is unused if block isn't shared
+static struct shared_block *shared_slot(unsigned int block) {
+    unsigned int i = (block * 2654435761u) & (shared_cap - 1);
+    while (shared[i].block != 0 && shared[i].block != block) i = (i + 1) & (shared_cap - 1);
+    return &shared[i];
+}
+
+// Returns the entry of shared block block, or NULL if block is claimed at most once
+static struct shared_block *shared_find(unsigned int block) {
+    if (shared_count == 0) return NULL;
+    struct shared_block *slot = shared_slot(block);
+    return slot->block == 0 ? NULL : slot;
+}
+
+// Adds block to the shared blocks, keeping the table at most half full
+static void shared_add(unsigned int block) {
+    pthread_mutex_lock(&shared_lock);
+    if (2 * (shared_count + 1) > shared_cap) {
+        struct shared_block *old = shared;
+        int old_cap = shared_cap;
+        shared_cap = shared_cap ? 2 * shared_cap : 64;
+        shared = calloc(shared_cap, sizeof(struct shared_block));
+        if (shared == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (int i = 0; i < old_cap; i++)
+            if (old[i].block != 0) *shared_slot(old[i].block) = old[i];
+        free(old);
+    }
+    struct shared_block *slot = shared_slot(block);
+    if (slot->block == 0) {
+        slot->block = block;
+        shared_count++;
+    }
+    pthread_mutex_unlock(&shared_lock);
+}
+
+// Returns nonzero if block holds a copy of the superblock or group descriptors, a bitmap or an inode table
+static int block_is_metadata(unsigned int block) {
+    int table_blocks = (sb->s_inodes_per_group * sb->s_inode_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int group = 0; group < group_count; group++) {
+        struct ext2_group_desc *desc = group_desc(group);
+        int first = group_first_block(group);
+        if (group_has_super(group) && block >= first && block < first + 1 + group_desc_blocks()) return 1;
+        if (block == desc->bg_block_bitmap || block == desc->bg_inode_bitmap) return 1;
+        if (block >= desc->bg_inode_table && block < desc->bg_inode_table + table_blocks) return 1;
+    }
+    return 0;
+}
 
-    if (inode == NULL) return 0;
-    if (entry->file_type != file_type) {
-        entry->file_type = file_type;
-        printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", entry->inode);
-        fixed++;
+// Returns nonzero if inode inode_index has to stop using block because metadata or a lower inode also claims it
+static int must_give_up(unsigned int block, int inode_index) {
+    if (inode_index != EXT2_ROOT_INO && inode_index < EXT2_GOOD_OLD_FIRST_INO) return 0; // The journal, resize inode...
+    struct shared_block *e = shared_find(block);
+    if (e == NULL) return 0;
+    return block_is_metadata(block) || e->owners[0] != inode_index;
+}
+
+/*
+ * Gives inode inode_index a copy of each block it must give up among those mapped through *slot, which maps
+ * a data block at depth 0 and an indirect block at depth 1 to 3, counting the copies in *copied and the
+ * blocks that couldn't be copied in *failed
+ */
+static void unshare_blocks(unsigned int *slot, int depth, long long *remaining, int inode_index,
+                           int *copied, int *failed) {
+    long long span = 1;
+    for (int d = 0; d < depth; d++) span *= ADDRS_PER_BLOCK;
+    if (*slot == 0 || !block_is_valid(*slot)) {
+        *remaining -= span;
+        return;
     }
-    if (!inode_is_allocated(entry->inode)) {
-        realloc_inode(entry->inode);
-        printf("Fixed: inode [%d] not marked as in-use\n", entry->inode);
-        fixed++;
+    if (must_give_up(*slot, inode_index)) {
+        int len;
+        int copy = alloc_data_extent(*slot, 1, &len);
+        if (copy == -1) {
+            (*failed)++;
+        } else {
+            memcpy(block_ptr(copy), block_ptr(*slot), BLOCK_SIZE);
+            *slot = copy;
+            bitmap_set(block_owned, copy);
+            (*copied)++;
+        }
     }
-    if (inode->i_dtime != 0) {
-        inode->i_dtime = 0;
-        fixed++;
-        printf("Fixed: valid inode marked for deletion: [%d]\n", entry->inode);
+    if (depth == 0) {
+        (*remaining)--;
+        return;
+    }
+    unsigned int *table = (unsigned int *)block_ptr(*slot);
+    for (int i = 0; i < ADDRS_PER_BLOCK && *remaining > 0; i++)
+        unshare_blocks(&table[i], depth - 1, remaining, inode_index, copied, failed);
+}
+
+/*
+ * Frees the blocks of group marked in use that nothing owns, if unowned != 0, or marks the blocks owned
+ * but free in use otherwise
+ * Returns the number of blocks changed
+ */
+static int fix_block_ownership(int group, int unowned) {
+    unsigned char *bitmap = block_bitmap(group);
+    int first = group_first_block(group);
+    int changed = 0;
+    for (int offset = 0; offset < group_block_count(group); offset++) {
+        int owned = bitmap_test(block_owned, first + offset);
+        if (unowned && !owned && bitmap_test(bitmap, offset)) {
+            zero_block_bitmap(first + offset);
+            adjust_free_blocks(first + offset, 1);
+            changed++;
+        } else if (!unowned && owned && !bitmap_test(bitmap, offset)) {
+            realloc_block(first + offset);
+            changed++;
+        }
     }
-    int blocks_fixed = 0;
-    for (int b = 0; b < inode->i_blocks / 2; b++)
-        if (!block_is_allocated(inode->i_block[b])) {
-            realloc_block(inode->i_block[b]);
-            blocks_fixed++;
+    return changed;
+}
+
+/*
+ * Applies f, printing what was fixed
+ * Returns the number of inconsistencies repaired, which is 0 if an earlier fix already repaired it
+ */
+int apply_fix(struct fix *f) {
+    struct ext2_group_desc *desc;
+    struct ext2_inode *inode;
+    int diff;
+    switch (f->kind) {
+        case FIX_GROUP_FREE_INODES:
+            desc = group_desc(f->inode);
+            diff = f->value - desc->bg_free_inodes_count;
+            printf("Fixed block group's free inodes counter was off by %d compared to the bitmap\n", diff);
+            desc->bg_free_inodes_count = f->value;
+            return abs(diff);
+        case FIX_GROUP_FREE_BLOCKS:
+            desc = group_desc(f->inode);
+            diff = f->value - desc->bg_free_blocks_count;
+            printf("Fixed block group's free blocks counter was off by %d compared to the bitmap\n", diff);
+            desc->bg_free_blocks_count = f->value;
+            return abs(diff);
+        case FIX_DTIME:
+            inode = inode_by_index(f->inode);
+            if (inode->i_dtime == 0) return 0;
+            inode->i_dtime = 0;
+            printf("Fixed: valid inode marked for deletion: [%d]\n", f->inode);
+            return 1;
+        case FIX_ENTRY_TYPE:
+            f->entry->file_type = f->value;
+            printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", f->inode);
+            return 1;
+        case FIX_INODE_BITMAP:
+            if (inode_is_allocated(f->inode)) return 0;
+            realloc_inode(f->inode);
+            printf("Fixed: inode [%d] not marked as in-use\n", f->inode);
+            return 1;
+        case FIX_BLOCK_BITMAP: {
+            int blocks_fixed = 0;
+            for_each_inode_block(inode_by_index(f->inode), fix_block_cb, &blocks_fixed);
+            if (blocks_fixed > 0) printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n",
+                                         blocks_fixed, f->inode);
+            return blocks_fixed;
         }
+        case FIX_UNATTACHED:
+            return fix_unattached(f->inode);
+        case FIX_LINK_COUNT:
+            inode = inode_by_index(f->inode);
+            if (inode->i_links_count == f->value) return 0;
+            printf("Fixed: inode [%d] link count was %d, should be %d\n", f->inode, inode->i_links_count, f->value);
+            inode->i_links_count = f->value;
+            return 1;
+        case FIX_UNOWNED_BLOCKS:
+            diff = fix_block_ownership(f->inode, 1);
+            printf("Fixed: %d blocks marked in use in group %d without an owner freed\n", diff, f->inode);
+            return diff;
+        case FIX_OWNED_BLOCKS:
+            diff = fix_block_ownership(f->inode, 0);
+            printf("Fixed: %d owned blocks not marked in use in group %d\n", diff, f->inode);
+            return diff;
+        case FIX_SHARED_BLOCKS: {
+            inode = inode_by_index(f->inode);
+            int copied = 0;
+            int failed = 0;
+            long long remaining = inode_data_blocks(inode);
+            for (int b = 0; b < EXT2_NDIR_BLOCKS && remaining > 0; b++)
+                unshare_blocks(&inode->i_block[b], 0, &remaining, f->inode, &copied, &failed);
+            for (int depth = 1; depth <= 3 && remaining > 0; depth++)
+                unshare_blocks(&inode->i_block[EXT2_IND_BLOCK + depth - 1], depth, &remaining, f->inode, &copied, &failed);
+            if (copied > 0) printf("Fixed: inode [%d] got its own copy of %d cross-linked blocks\n", f->inode, copied);
+            if (failed > 0) printf("Couldn't copy %d cross-linked blocks of inode [%d]: no space\n", failed, f->inode);
+            return copied;
+        }
+    }
+    return 0;
+}
 
-    if (blocks_fixed > 0) printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n",
-                                 blocks_fixed, entry->inode);
-    return fixed + blocks_fixed;
+// Orders fixes by inode, then by kind, then by the order they were queued in
+static int compare_fixes(const void *a, const void *b) {
+    const struct fix *x = a;
+    const struct fix *y = b;
+    if (x->inode != y->inode) return x->inode - y->inode;
+    if (x->kind != y->kind) return x->kind - y->kind;
+    return x->seq - y->seq;
 }
 
-int rec_fix_entries(struct ext2_dir_entry *dir) {
+/*
+ * Applies and empties the fix queue. Returns the number of inconsistencies repaired
+ */
+int apply_fixes() {
     int fixed = 0;
+    if (fix_count > 0) qsort(fixes, fix_count, sizeof(struct fix), compare_fixes);
+    for (int i = 0; i < fix_count; i++) fixed += apply_fix(&fixes[i]);
+    fix_count = 0;
+    return fixed;
+}
+
+/*
+ * Checks one block group: its free counters against its bitmaps, and the in-use inodes of its inode table
+ * arg is the group number
+ */
+void check_group(void *arg) {
+    int group = (int)(intptr_t)arg;
+    struct ext2_group_desc *desc = group_desc(group);
+    int free_inodes = bitmap_count_zero(inode_bitmap(group), sb->s_inodes_per_group);
+    int free_blocks = bitmap_count_zero(block_bitmap(group), group_block_count(group));
+    if (free_inodes != desc->bg_free_inodes_count) queue_fix(FIX_GROUP_FREE_INODES, group, free_inodes, NULL);
+    if (free_blocks != desc->bg_free_blocks_count) queue_fix(FIX_GROUP_FREE_BLOCKS, group, free_blocks, NULL);
+
+    unsigned char *bitmap = inode_bitmap(group);
+    int offset = 0;
+    while ((offset = bitmap_find_set(bitmap, offset, sb->s_inodes_per_group)) != -1) {
+        int node_no = group * sb->s_inodes_per_group + offset + 1;
+        offset++;
+        if (node_no != EXT2_ROOT_INO && node_no < EXT2_GOOD_OLD_FIRST_INO) continue; // Skip reserved inodes
+        struct ext2_inode *inode = inode_by_index(node_no);
+        // An inode in use that has a type and links but is stamped as deleted
+        if (inode->i_dtime != 0 && inode->i_links_count > 0 && (inode->i_mode & EXT2_S_IFMT) != 0)
+            queue_fix(FIX_DTIME, node_no, 0, NULL);
+    }
+}
+
+/*
+ * Checks that inode inode_index, which is in use, has no deletion time and all of its blocks marked in use
+ */
+void check_inode(int inode_index) {
+    struct ext2_inode *inode = inode_by_index(inode_index);
+    if (inode->i_dtime != 0) queue_fix(FIX_DTIME, inode_index, 0, NULL);
+    int unmarked = 0;
+    for_each_inode_block(inode, count_unmarked_cb, &unmarked);
+    if (unmarked > 0) queue_fix(FIX_BLOCK_BITMAP, inode_index, 0, NULL);
+}
+
+/*
+ * Checks the inode entry refers to, expecting it to have type file_type
+ */
+void check_entry(struct ext2_dir_entry *entry, unsigned file_type) {
+    struct ext2_inode *inode = inode_by_index(entry->inode);
+
+    if (inode == NULL) return;
+    if (entry->file_type != file_type) queue_fix(FIX_ENTRY_TYPE, entry->inode, file_type, entry);
+    if (!inode_is_allocated(entry->inode)) queue_fix(FIX_INODE_BITMAP, entry->inode, 0, NULL);
+    check_inode(entry->inode);
+}
+
+void check_dir(void *arg);
+
+// Counts entry c, which refers to a valid inode, in the walk's reference counts
+static void count_ref(struct ext2_dir_entry *c) {
+    __atomic_fetch_add(&link_refs[c->inode - 1], 1, __ATOMIC_RELAXED);
+    int dots = (c->name_len == 1 || c->name_len == 2) && memcmp(c->name, "..", c->name_len) == 0;
+    if (!dots && !bitmap_test(inode_named, c->inode - 1)) bitmap_test_and_set_atomic(inode_named, c->inode - 1);
+}
+
+/*
+ * Checks every entry of a directory block, queueing a check_dir task for each directory not seen before
+ */
+SPECIALIZED void check_dir_block_sized(struct ext2_dir_entry *dir, const int block_size) {
     struct ext2_dir_entry *c = dir;
     int s = 0;
-    struct list *tmp; // Buffer for iterating over lists
     struct ext2_inode *inode; // Holds the inode we are currently checking
 
     while (s < BLOCK_SIZE) {
+        if (c->rec_len == 0) break; // Corrupt entry, the rest of the block can't be walked
         s += c->rec_len;
-        int already_checked_inode = 0;
-        tmp = inode_list;
-        while (tmp != NULL) {
-            if (tmp->val == c->inode) {
-                already_checked_inode = 1;
-                break;
+        inode = inode_by_index(c->inode);
+        if (inode != NULL && link_refs != NULL) count_ref(c);
+        if (inode != NULL && !bitmap_test_and_set_atomic(inode_seen, c->inode - 1)) {
+            switch (inode->i_mode & EXT2_S_IFMT) {
+                case EXT2_S_IFDIR:
+                    check_entry(c, EXT2_FT_DIR);
+                    if (walk_subdirs) run_task(check_dir, (void *)(intptr_t)c->inode);
+                    break;
+                case EXT2_S_IFREG:
+                    check_entry(c, EXT2_FT_REG_FILE);
+                    break;
+                case EXT2_S_IFLNK:
+                    check_entry(c, EXT2_FT_SYMLINK);
+                    break;
             }
-            tmp = tmp->next;
         }
+        c = (struct ext2_dir_entry *) (((char *) c) + c->rec_len);
+    }
+}
 
-        inode = inode_by_index(c->inode);
-        if (!already_checked_inode) {
-            if (inode->i_mode & EXT2_S_IFDIR) {
-                fixed += fix_entry(c, EXT2_FT_DIR);
-                for (int b = 0; b < inode->i_blocks / 2; b++) {
-                    tmp = block_list;
-                    int done = 0;
-                    while (tmp->next != NULL) {
-                        if (tmp->val == inode->i_block[b]) done = 1;
-                        tmp = tmp->next;
-                    }
-                    if (done) continue;
-                    struct list *new_block = malloc(sizeof(struct list));
-                    if (new_block == NULL) return 0;
-                    new_block->val = inode->i_block[b];
-                    new_block->next = NULL;
-                    tmp->next = new_block;
-                    fixed += rec_fix_entries((struct ext2_dir_entry *) (disk + BLOCK_SIZE * inode->i_block[b]));
-                }
-            } else if (inode->i_mode & EXT2_S_IFREG) {
-                fixed += fix_entry(c, EXT2_FT_REG_FILE);
-            } else if (inode->i_mode & EXT2_S_IFLNK) {
-                fixed += fix_entry(c, EXT2_FT_SYMLINK);
-            }
+void check_dir_block(struct ext2_dir_entry *dir) {
+    BLOCK_SIZE_SPECIALIZE(check_dir_block_sized, dir);
+}
+
+/*
+ * Walks the blocks of a directory that haven't been walked yet
+ * arg is the directory's inode number
+ */
+void check_dir(void *arg) {
+    struct ext2_inode *inode = inode_by_index((int)(intptr_t)arg);
+    struct block_iter it;
+    unsigned int block;
+    block_iter_init(&it, inode);
+    while (block_iter_next(&it, &block)) {
+        if (!block_is_valid(block) || bitmap_test_and_set_atomic(block_seen, block)) continue;
+        check_dir_block((struct ext2_dir_entry *)block_ptr(block));
+    }
+}
+
+/*
+ * Checks a logged inode that hasn't been checked through an entry
+ * arg is the inode number
+ */
+void check_logged_inode(void *arg) {
+    check_inode((int)(intptr_t)arg);
+}
+
+/*
+ * Calls fn(inode, arg) for each inode in use in group, skipping the reserved inodes other than the root
+ * unless reserved != 0
+ */
+static void for_each_group_inode(int group, int reserved, void (*fn)(int inode_index, void *arg), void *arg) {
+    unsigned char *bitmap = inode_bitmap(group);
+    for (int offset = bitmap_find_set(bitmap, 0, sb->s_inodes_per_group); offset != -1;
+         offset = bitmap_find_set(bitmap, offset + 1, sb->s_inodes_per_group)) {
+        int inode_index = group * sb->s_inodes_per_group + offset + 1;
+        if (!reserved && inode_index != EXT2_ROOT_INO && inode_index < EXT2_GOOD_OLD_FIRST_INO) continue;
+        fn(inode_index, arg);
+    }
+}
+
+// for_each_group_inode callback walking a directory the walk from the root didn't reach
+static void walk_unreached_cb(int inode_index, void *arg) {
+    struct ext2_inode *inode = inode_by_index(inode_index);
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR && !bitmap_test_and_set_atomic(inode_seen, inode_index - 1)) {
+        check_inode(inode_index);
+        run_task(check_dir, (void *)(intptr_t)inode_index);
+    }
+}
+
+/*
+ * Walks the directories in use in a group that no entry reached, so what lies below them is counted too
+ * arg is the group number
+ */
+void walk_unreached(void *arg) {
+    for_each_group_inode((int)(intptr_t)arg, 0, walk_unreached_cb, NULL);
+}
+
+// for_each_group_inode callback queueing a fix for an inode no entry names, if it is to be freed or reattached now
+static void find_unattached_cb(int inode_index, void *arg) {
+    if (inode_index != EXT2_ROOT_INO && !bitmap_test(inode_named, inode_index - 1) &&
+        unattached_is_dead(inode_by_index(inode_index)) != reattaching)
+        queue_fix(FIX_UNATTACHED, inode_index, 0, NULL);
+}
+
+/*
+ * Finds the inodes in use in a group that no entry refers to: those to free, or with reattaching set those to
+ * reattach, which needs blocks for /lost+found
+ * arg is the group number
+ */
+void find_unattached(void *arg) {
+    for_each_group_inode((int)(intptr_t)arg, 0, find_unattached_cb, NULL);
+}
+
+// for_each_group_inode callback queueing a fix for an inode whose link count isn't its number of entries
+static void check_links_cb(int inode_index, void *arg) {
+    int refs = link_refs[inode_index - 1];
+    if (refs > 0 && inode_by_index(inode_index)->i_links_count != refs) queue_fix(FIX_LINK_COUNT, inode_index, refs, NULL);
+}
+
+/*
+ * Checks the link counts of the inodes in use in a group against the entries found for them
+ * arg is the group number
+ */
+void check_links(void *arg) {
+    for_each_group_inode((int)(intptr_t)arg, 0, check_links_cb, NULL);
+}
 
-            struct list *new_inode = malloc(sizeof(struct list));
-            if (new_inode == NULL) return 0;
-            new_inode->next = inode_list;
-            new_inode->val = c->inode;
-            inode_list = new_inode;
+// Marks the superblock and group descriptor copies, bitmaps and inode tables of every group as owned
+static void claim_metadata() {
+    int table_blocks = (sb->s_inodes_per_group * sb->s_inode_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int group = 0; group < group_count; group++) {
+        struct ext2_group_desc *desc = group_desc(group);
+        if (group_has_super(group)) {
+            for (int b = 0; b < 1 + group_desc_blocks(); b++) bitmap_set(block_owned, group_first_block(group) + b);
         }
+        if (block_is_valid(desc->bg_block_bitmap)) bitmap_set(block_owned, desc->bg_block_bitmap);
+        if (block_is_valid(desc->bg_inode_bitmap)) bitmap_set(block_owned, desc->bg_inode_bitmap);
+        for (int b = 0; b < table_blocks; b++)
+            if (block_is_valid(desc->bg_inode_table + b)) bitmap_set(block_owned, desc->bg_inode_table + b);
+    }
+}
 
-        c = (struct ext2_dir_entry *) (((char *) c) + c->rec_len);
+// for_each_inode_block callback claiming block, adding it to the shared blocks if it was claimed already
+static void claim_block_cb(unsigned int block, void *arg) {
+    if (bitmap_test_and_set_atomic(block_owned, block)) shared_add(block);
+}
+
+// for_each_group_inode callback claiming the blocks of an inode
+static void claim_inode_cb(int inode_index, void *arg) {
+    struct ext2_inode *inode = inode_by_index(inode_index);
+    if (inode_index >= EXT2_GOOD_OLD_FIRST_INO && (inode->i_mode & EXT2_S_IFMT) == 0) return;
+    for_each_inode_block(inode, claim_block_cb, NULL);
+    // Extended attribute blocks are shared on purpose, with their own reference count
+    if (block_is_valid(inode->i_file_acl)) bitmap_test_and_set_atomic(block_owned, inode->i_file_acl);
+}
+
+/*
+ * Claims the blocks of the inodes in use in a group, reserved ones included
+ * arg is the group number
+ */
+void claim_blocks(void *arg) {
+    for_each_group_inode((int)(intptr_t)arg, 1, claim_inode_cb, NULL);
+}
+
+// for_each_inode_block callback adding the inode *(int *)arg to the owners of block if it is shared
+static void collect_owner_cb(unsigned int block, void *arg) {
+    struct shared_block *e = shared_find(block);
+    if (e == NULL) return;
+    int inode_index = *(int *)arg;
+    pthread_mutex_lock(&shared_lock);
+    int i = 0;
+    while (i < e->owner_count && e->owners[i] != inode_index) i++;
+    if (i == e->owner_count) {
+        if (e->owner_count == e->owner_cap) {
+            e->owner_cap = e->owner_cap ? 2 * e->owner_cap : 4;
+            e->owners = realloc(e->owners, e->owner_cap * sizeof(int));
+            if (e->owners == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        e->owners[e->owner_count++] = inode_index;
     }
-    return fixed;
+    pthread_mutex_unlock(&shared_lock);
+}
+
+// for_each_group_inode callback collecting an inode as an owner of its shared blocks
+static void collect_inode_cb(int inode_index, void *arg) {
+    struct ext2_inode *inode = inode_by_index(inode_index);
+    if (inode_index >= EXT2_GOOD_OLD_FIRST_INO && (inode->i_mode & EXT2_S_IFMT) == 0) return;
+    for_each_inode_block(inode, collect_owner_cb, &inode_index);
+}
+
+/*
+ * Collects the inodes in use in a group as owners of the shared blocks they claim
+ * arg is the group number
+ */
+void collect_owners(void *arg) {
+    for_each_group_inode((int)(intptr_t)arg, 1, collect_inode_cb, NULL);
+}
+
+/*
+ * Compares a group's block bitmap with the blocks owned in it
+ * arg is the group number
+ */
+void check_block_ownership(void *arg) {
+    int group = (int)(intptr_t)arg;
+    unsigned char *bitmap = block_bitmap(group);
+    int first = group_first_block(group);
+    int unowned = 0;
+    int unmarked = 0;
+    for (int offset = 0; offset < group_block_count(group); offset++) {
+        int owned = bitmap_test(block_owned, first + offset);
+        if (!owned && bitmap_test(bitmap, offset)) unowned++;
+        if (owned && !bitmap_test(bitmap, offset)) unmarked++;
+    }
+    if (unowned > 0) queue_fix(FIX_UNOWNED_BLOCKS, group, unowned, NULL);
+    if (unmarked > 0) queue_fix(FIX_OWNED_BLOCKS, group, unmarked, NULL);
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Orders pointers to shared blocks by block
+static int compare_shared(const void *a, const void *b) {
+    unsigned int x = (*(struct shared_block *const *)a)->block;
+    unsigned int y = (*(struct shared_block *const *)b)->block;
+    return (x > y) - (x < y);
+}
+
+// Waits for the phase's tasks to finish
+void finish_phase() {
+    if (pool != NULL) pool_wait(pool);
+}
+
+/*
+ * Reads the dirty log at log_path, setting the bits of the groups, inodes and directories it names
+ * Returns 1 if it was read, 0 if there is none, or -1 if it can't be trusted because a run didn't finish
+ * writing it or it is damaged
+ */
+static int read_dirty_log(char *log_path, unsigned char *groups, unsigned char *inodes, unsigned char *dirs) {
+    FILE *log = fopen(log_path, "r");
+    if (log == NULL) return errno == ENOENT ? 0 : -1;
+    char kind[16];
+    int n;
+    int in_run = 0; // 1 between a begin and its end
+    int ok = 1;
+    while (ok && fscanf(log, "%15s", kind) == 1) {
+        if (strcmp(kind, "begin") == 0) {
+            ok = !in_run;
+            in_run = 1;
+        } else if (strcmp(kind, "end") == 0) {
+            ok = in_run;
+            in_run = 0;
+        } else if (!in_run || fscanf(log, "%d", &n) != 1) {
+            ok = 0;
+        } else if (strcmp(kind, "group") == 0 && n >= 0 && n < group_count) {
+            bitmap_set(groups, n);
+        } else if (strcmp(kind, "inode") == 0 && inode_is_valid(n)) {
+            bitmap_set(inodes, n - 1);
+        } else if (strcmp(kind, "dir") == 0 && inode_is_valid(n)) {
+            bitmap_set(dirs, n - 1);
+        } else {
+            ok = 0;
+        }
+    }
+    fclose(log);
+    return ok && !in_run ? 1 : -1;
+}
+
+// Returns the number of set bits in the first nbits bits of bitmap
+static int count_set(unsigned char *bitmap, int nbits) {
+    return nbits - bitmap_count_zero(bitmap, nbits);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
+    static struct option long_options[] = {
+        { "incremental", no_argument, NULL, 'i' },
+        { NULL, 0, NULL, 0 },
+    };
+    int threads = 1;
+    int incremental = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        if (opt == 'i') {
+            incremental = 1;
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            threads = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [--incremental] [-j threads] <image file name>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [--incremental] [-j threads] <image file name>\n", argv[0]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
+    dirty_log.disabled = 1; // Once this check is done there is nothing left for the log to point at
+    open_image(argv[optind]);
+    char *log_path = dirty_log_path(argv[optind]);
+    unsigned char *log_groups = calloc((group_count + 7) / 8, 1);
+    unsigned char *log_inodes = calloc((sb->s_inodes_count + 7) / 8, 1);
+    unsigned char *log_dirs = calloc((sb->s_inodes_count + 7) / 8, 1);
+    if (log_groups == NULL || log_inodes == NULL || log_dirs == NULL) {
+        perror("calloc");
         exit(1);
     }
-
-    sb = (struct ext2_super_block *) (disk + BLOCK_SIZE);
-    gd = (struct ext2_group_desc *) (disk + BLOCK_SIZE + sizeof(struct ext2_super_block));
+    if (incremental && read_dirty_log(log_path, log_groups, log_inodes, log_dirs) == -1) {
+        printf("The dirty log is incomplete, checking the whole image\n");
+        incremental = 0;
+    } else if (incremental) {
+        printf("Checking %d groups, %d directories and %d inodes from the dirty log\n", count_set(log_groups, group_count),
+               count_set(log_dirs, sb->s_inodes_count), count_set(log_inodes, sb->s_inodes_count));
+    }
+    if (threads > 1) {
+        pool = pool_create(threads);
+        if (pool == NULL) {
+            fprintf(stderr, "Couldn't start %d threads\n", threads);
+            exit(1);
+        }
+    }
 
     int err_count = 0;
     int diff;
 
-    /** Verify free inode counts **/
+    /** Verify free inode and block counts and inode deletion times of every group **/
+    for (int group = 0; group < group_count; group++)
+        if (!incremental || bitmap_test(log_groups, group)) run_task(check_group, (void *)(intptr_t)group);
+    finish_phase();
+    err_count += apply_fixes();
+    // The group counters now match the bitmaps, so the superblock's totals should be their sums
     int real_free_inodes = 0;
-    for (int byte = 0; byte < sb->s_inodes_count; byte++)
-        for (int bit = 0; bit < 8; bit++)
-            if (!((disk[BLOCK_SIZE * gd->bg_inode_bitmap + byte] >> bit) & 1)) real_free_inodes++;
+    int real_free_blocks = 0;
+    for (int group = 0; group < group_count; group++) {
+        real_free_inodes += group_desc(group)->bg_free_inodes_count;
+        real_free_blocks += group_desc(group)->bg_free_blocks_count;
+    }
     if (real_free_inodes != sb->s_free_inodes_count) {
         diff = real_free_inodes - sb->s_free_inodes_count;
         printf("Fixed superblock's free inodes counter was off by %d compared to the bitmap\n", diff);
         sb->s_free_inodes_count = real_free_inodes;
-        err_count += diff;
+        err_count += abs(diff);
     }
-    if (real_free_inodes != gd->bg_free_inodes_count) {
-        diff = real_free_inodes - gd->bg_free_inodes_count;
-        printf("Fixed block group's free inodes counter was off by %d compared to the bitmap\n", diff);
-        gd->bg_free_inodes_count = real_free_inodes;
-        err_count += diff;
-    }
-
-    /** Verify free block counts **/
-    int real_free_blocks = 0;
-    for (int byte = 0; byte < sb->s_blocks_count; byte++)
-        for (int bit = 0; bit < 8; bit++)
-            if (!((disk[BLOCK_SIZE * gd->bg_block_bitmap + byte] >> bit) & 1)) real_free_blocks++;
     if (real_free_blocks != sb->s_free_blocks_count) {
         diff = real_free_blocks - sb->s_free_blocks_count;
         printf("Fixed superblock's free blocks counter was off by %d compared to the bitmap\n", diff);
         sb->s_free_blocks_count = real_free_blocks;
-        err_count += diff;
+        err_count += abs(diff);
     }
-    if (real_free_blocks != gd->bg_free_blocks_count) {
-        diff = real_free_blocks - gd->bg_free_blocks_count;
-        printf("Fixed block group's free blocks counter was off by %d compared to the bitmap\n", diff);
-        gd->bg_free_blocks_count = real_free_blocks;
-        err_count += diff;
+
+    /** Walk the directory tree from the root, or just the logged directories and inodes **/
+    inode_seen = calloc((sb->s_inodes_count + 7) / 8, 1);
+    block_seen = calloc((sb->s_blocks_count + 7) / 8, 1);
+    if (inode_seen == NULL || block_seen == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (incremental) {
+        walk_subdirs = 0;
+        int inodes = sb->s_inodes_count;
+        for (int bit = bitmap_find_set(log_dirs, 0, inodes); bit != -1; bit = bitmap_find_set(log_dirs, bit + 1, inodes)) {
+            struct ext2_inode *dir = inode_by_index(bit + 1);
+            if (inode_is_allocated(bit + 1) && (dir->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+                run_task(check_dir, (void *)(intptr_t)(bit + 1));
+        }
+        for (int bit = bitmap_find_set(log_inodes, 0, inodes); bit != -1; bit = bitmap_find_set(log_inodes, bit + 1, inodes)) {
+            if (bit + 1 != EXT2_ROOT_INO && bit + 1 < EXT2_GOOD_OLD_FIRST_INO) continue; // Skip reserved inodes
+            if (inode_is_allocated(bit + 1) && !bitmap_test_and_set_atomic(inode_seen, bit))
+                run_task(check_logged_inode, (void *)(intptr_t)(bit + 1));
+        }
+    } else {
+        link_refs = calloc(sb->s_inodes_count, sizeof(int));
+        inode_named = calloc((sb->s_inodes_count + 7) / 8, 1);
+        if (link_refs == NULL || inode_named == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        run_task(check_dir, (void *)(intptr_t)EXT2_ROOT_INO);
     }
+    finish_phase();
+    err_count += apply_fixes();
+
+    if (!incremental) {
+        /** Count what lies below the directories the walk didn't reach, then free what nothing names and is dead **/
+        for (int group = 0; group < group_count; group++) run_task(walk_unreached, (void *)(intptr_t)group);
+        finish_phase();
+        err_count += apply_fixes();
+        for (int group = 0; group < group_count; group++) run_task(find_unattached, (void *)(intptr_t)group);
+        finish_phase();
+        err_count += apply_fixes();
+
+        /** Map the owner of every block to find bitmap bits nothing owns and cross-linked blocks **/
+        block_owned = calloc((sb->s_blocks_count + 7) / 8, 1);
+        if (block_owned == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        claim_metadata();
+        for (int group = 0; group < group_count; group++) run_task(claim_blocks, (void *)(intptr_t)group);
+        finish_phase();
+        // Mark the owned blocks in use before any repair allocates, so none is handed out again
+        for (int group = 0; group < group_count; group++) run_task(check_block_ownership, (void *)(intptr_t)group);
+        finish_phase();
+        err_count += apply_fixes();
+        if (shared_count > 0) {
+            for (int group = 0; group < group_count; group++) run_task(collect_owners, (void *)(intptr_t)group);
+            finish_phase();
+            // Report in block order, which the table's order depends on how the threads interleaved
+            struct shared_block **sorted = malloc(shared_count * sizeof(struct shared_block *));
+            if (sorted == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            int n = 0;
+            for (int i = 0; i < shared_cap; i++)
+                if (shared[i].block != 0) sorted[n++] = &shared[i];
+            qsort(sorted, n, sizeof(struct shared_block *), compare_shared);
+            for (int i = 0; i < n; i++) {
+                struct shared_block *e = sorted[i];
+                qsort(e->owners, e->owner_count, sizeof(int), compare_ints);
+                printf("Block %u is claimed by%s", e->block, block_is_metadata(e->block) ? " metadata and" : "");
+                for (int o = 0; o < e->owner_count; o++) printf(" [%d]", e->owners[o]);
+                printf("\n");
+                for (int o = 0; o < e->owner_count; o++)
+                    if (must_give_up(e->block, e->owners[o])) queue_fix(FIX_SHARED_BLOCKS, e->owners[o], 0, NULL);
+            }
+            free(sorted);
+            err_count += apply_fixes();
+        }
 
-    struct ext2_inode *inode = (struct ext2_inode *) (disk + BLOCK_SIZE * gd->bg_inode_table + sb->s_inode_size * (EXT2_ROOT_INO - 1));
-    block_list = malloc(sizeof(struct list));
-    block_list->next = NULL;
-    block_list->val = 0; // Ensure first element has value 0 so we don't segfault trying to check invalid blocks
-    inode_list = malloc(sizeof(struct list));
-    inode_list->next = NULL;
-    inode_list->val = 0; // Ensure first element has value 0 so we don't segfault trying to check invalid inodes
-    for (int b = 0; b < inode->i_blocks / 2; b++) {
-        err_count += rec_fix_entries((struct ext2_dir_entry *) (disk + BLOCK_SIZE * inode->i_block[b]));
+        /** Reattach the rest of what nothing names **/
+        reattaching = 1;
+        for (int group = 0; group < group_count; group++) run_task(find_unattached, (void *)(intptr_t)group);
+        finish_phase();
+        err_count += apply_fixes();
+
+        /** Compare link counts with the entries found for each inode **/
+        for (int group = 0; group < group_count; group++) run_task(check_links, (void *)(intptr_t)group);
+        finish_phase();
+        err_count += apply_fixes();
     }
+
+    if (pool != NULL) pool_destroy(pool);
+    close_image();
+    if (unlink(log_path) == -1 && errno != ENOENT) perror(log_path);
     if (err_count == 0) printf("No file system inconsistencies detected!\n");
     else printf("%d file system inconsistencies repaired!\n", err_count);
     return 0;
@@ -0,0 +1,224 @@
+#include "ext2_utils.c"
+
+/*
+ * Repacks directories: their entries are moved to the front of their blocks with no gaps between them,
+ * in their current order or sorted by name with -s, and the blocks left empty at the end are freed.
+ * Deleted entries are dropped on the way, so ext2_restore can't bring back files deleted from a
+ * directory before it was compacted. A directory whose sorted entries would need more blocks than it has is
+ * packed in its current order instead, which always fits. lost+found is left alone, since e2fsck relies on
+ * the blocks it was created with
+ */
+
+// An entry copied out of a directory while it is repacked
+struct compact_entry {
+    unsigned int inode;
+    unsigned char name_len;
+    unsigned char file_type;
+    char name[EXT2_NAME_LEN];
+};
+
+// Returns 0 for ., 1 for .. and 2 for any other name
+static int dot_rank(const struct compact_entry *e) {
+    if (e->name_len == 1 && e->name[0] == '.') return 0;
+    if (e->name_len == 2 && e->name[0] == '.' && e->name[1] == '.') return 1;
+    return 2;
+}
+
+// Orders entries by name, keeping . and .. first
+static int compare_entries(const void *a, const void *b) {
+    const struct compact_entry *x = a;
+    const struct compact_entry *y = b;
+    if (dot_rank(x) != dot_rank(y)) return dot_rank(x) - dot_rank(y);
+    int n = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+    return n != 0 ? n : x->name_len - y->name_len;
+}
+
+/*
+ * Copies the entries in use of directory block block onto the end of *entries, which holds *count in room for *cap
+ * Returns 0 on success or EIO if the block's entries don't add up to the block
+ */
+SPECIALIZED int compact_read_block(unsigned int block, struct compact_entry **entries, int *count, int *cap,
+                                   const int block_size) {
+    int sum = 0;
+    while (sum < BLOCK_SIZE) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block_ptr(block) + sum);
+        if (entry->rec_len < EXT2_DIR_REC_LEN(0) || sum + entry->rec_len > BLOCK_SIZE ||
+            EXT2_DIR_REC_LEN(entry->name_len) > entry->rec_len) return EIO;
+        if (entry->inode != 0) {
+            if (*count == *cap) {
+                *cap = *cap ? 2 * *cap : 64;
+                *entries = realloc(*entries, *cap * sizeof(struct compact_entry));
+                if (*entries == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            struct compact_entry *e = &(*entries)[(*count)++];
+            e->inode = entry->inode;
+            e->name_len = entry->name_len;
+            e->file_type = entry->file_type;
+            memcpy(e->name, entry->name, entry->name_len);
+        }
+        sum += entry->rec_len;
+    }
+    return 0;
+}
+
+/*
+ * Returns the number of blocks compact_write_block takes to write all count entries, at least 1
+ */
+SPECIALIZED int compact_layout_blocks(struct compact_entry *entries, int count, const int block_size) {
+    int blocks = 1;
+    int sum = 0;
+    for (int i = 0; i < count; i++) {
+        int rec_len = EXT2_DIR_REC_LEN(entries[i].name_len);
+        if (sum + rec_len > BLOCK_SIZE) {
+            blocks++;
+            sum = 0;
+        }
+        sum += rec_len;
+    }
+    return blocks;
+}
+
+/*
+ * Writes entries[*next...] into block, as many as fit, advancing *next past them
+ */
+SPECIALIZED void compact_write_block(unsigned int block, struct compact_entry *entries, int count, int *next,
+                                     const int block_size) {
+    unsigned char *data = block_ptr(block);
+    memset(data, 0, BLOCK_SIZE);
+    struct ext2_dir_entry *last = NULL;
+    int sum = 0;
+    for (; *next < count && sum + EXT2_DIR_REC_LEN(entries[*next].name_len) <= BLOCK_SIZE; (*next)++) {
+        struct compact_entry *e = &entries[*next];
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(data + sum);
+        entry->inode = e->inode;
+        entry->rec_len = EXT2_DIR_REC_LEN(e->name_len);
+        entry->name_len = e->name_len;
+        entry->file_type = e->file_type;
+        memcpy(entry->name, e->name, e->name_len);
+        sum += entry->rec_len;
+        last = entry;
+    }
+    // The last entry takes up the rest of the block, or an empty entry does if nothing fit
+    if (last == NULL) ((struct ext2_dir_entry *)data)->rec_len = BLOCK_SIZE;
+    else last->rec_len += BLOCK_SIZE - sum;
+}
+
+/*
+ * Repacks directory dir, sorting its entries by name if sort != 0, and adds the blocks it freed to *freed
+ * Returns 0 on success or EIO if its blocks are corrupt, in which case it is left alone
+ */
+int compact_dir(struct ext2_inode *dir, int sort, int *freed) {
+    int max_blocks = inode_data_blocks(dir);
+    if (max_blocks == 0) return 0;
+    struct compact_entry *entries = NULL;
+    int count = 0;
+    int cap = 0;
+    unsigned int *blocks = malloc(max_blocks * sizeof(unsigned int)); // The directory's blocks, holes left out
+    int *lblks = malloc(max_blocks * sizeof(int)); // The logical index of each of blocks
+    if (blocks == NULL || lblks == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int nblocks = 0;
+    struct block_iter it;
+    unsigned int block;
+    block_iter_init(&it, dir);
+    for (int lblk = 0; block_iter_next(&it, &block); lblk++) {
+        if (block == 0) continue; // A hole
+        if (!block_is_valid(block) ||
+            BLOCK_SIZE_SPECIALIZE(compact_read_block, block, &entries, &count, &cap) != 0) {
+            free(entries);
+            free(blocks);
+            free(lblks);
+            return EIO;
+        }
+        blocks[nblocks] = block;
+        lblks[nblocks++] = lblk;
+    }
+    if (nblocks == 0) {
+        free(entries);
+        free(blocks);
+        free(lblks);
+        return 0;
+    }
+    if (sort && count > 0) qsort(entries, count, sizeof(struct compact_entry), compare_entries);
+    int needed = BLOCK_SIZE_SPECIALIZE(compact_layout_blocks, entries, count);
+    if (needed > nblocks) {
+        // Sorted, the entries pack worse than the blocks they came from, so read them again in their current
+        // order. Packed in order they need no more blocks than they fill now
+        count = 0;
+        for (int i = 0; i < nblocks; i++) BLOCK_SIZE_SPECIALIZE(compact_read_block, blocks[i], &entries, &count, &cap);
+        needed = BLOCK_SIZE_SPECIALIZE(compact_layout_blocks, entries, count);
+    }
+
+    int next = 0;
+    for (int used = 0; used < needed; used++)
+        BLOCK_SIZE_SPECIALIZE(compact_write_block, blocks[used], entries, count, &next);
+    if (next != count) { // Never free blocks while entries are left to write
+        fprintf(stderr, "compact: %d entries didn't fit in %d blocks\n", count - next, needed);
+        exit(1);
+    }
+    // A hashed index lived in the blocks just rewritten, so the directory is a plain one now
+    dir->i_flags &= ~EXT2_INDEX_FL;
+    unsigned int before = dir->i_blocks;
+    inode_truncate(dir, lblks[needed - 1] + 1);
+    dir->i_size = (unsigned int)(lblks[needed - 1] + 1) * BLOCK_SIZE;
+    *freed += (before - dir->i_blocks) / DISK_SECS_PER_BLOCK;
+    dir_index_rebuild(dir);
+    free(entries);
+    free(blocks);
+    free(lblks);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int sort = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') {
+            sort = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-s] <image file name> [absolute path of a directory]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        fprintf(stderr, "Usage: %s [-s] <image file name> [absolute path of a directory]\n", argv[0]);
+        exit(1);
+    }
+    open_image(argv[optind]);
+    struct ext2_dir_entry *lost_found = get_dir_entry_by_path("/lost+found", 0);
+    int lost_found_ino = lost_found != NULL && lost_found->file_type == EXT2_FT_DIR ? lost_found->inode : 0;
+    int err = 0;
+    int dirs = 0;
+    int freed = 0;
+    if (optind == argc - 2) { // Just the one directory
+        struct ext2_dir_entry *entry = get_dir_entry_by_path(argv[optind + 1], 0);
+        if (entry == NULL) err = ENOENT;
+        else if (entry->file_type != EXT2_FT_DIR) err = ENOTDIR;
+        else if (entry->inode != lost_found_ino && (err = compact_dir(inode_by_index(entry->inode), sort, &freed)) == 0)
+            dirs++;
+    } else { // Every directory in use
+        for (int group = 0; group < group_count; group++) {
+            unsigned char *bitmap = inode_bitmap(group);
+            for (int offset = bitmap_find_set(bitmap, 0, sb->s_inodes_per_group); offset != -1;
+                 offset = bitmap_find_set(bitmap, offset + 1, sb->s_inodes_per_group)) {
+                int inode_index = group * sb->s_inodes_per_group + offset + 1;
+                struct ext2_inode *inode = inode_by_index(inode_index);
+                if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR || inode_index == lost_found_ino) continue;
+                if (compact_dir(inode, sort, &freed) == 0) {
+                    dirs++;
+                } else {
+                    fprintf(stderr, "Directory inode %d is corrupt, left as it is\n", inode_index);
+                    err = EIO;
+                }
+            }
+        }
+    }
+    if (err != ENOENT && err != ENOTDIR) printf("Compacted %d directories, freed %d blocks\n", dirs, freed);
+    close_image();
+    return err;
+}
@@ -1,86 +1,366 @@
 #include <sys/stat.h>
+#include <limits.h>
+#include <dirent.h>
 #include "ext2_utils.c"
+#include "ext2_pool.c"
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
+/*
+ * Copying a file is split in two: cp_alloc() creates the entry and inode and allocates every block on the
+ * calling thread, then cp_copy() fills the blocks with the file's data. cp_copy() only writes to the blocks
+ * of its own inode, so the copies of different files can run on a pool while more files are allocated
+ */
 
-int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <image file name> <path on local system> <absolute path on virtual disk>\n", argv[0]);
-        exit(1);
-    }
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
+// A file whose blocks have been allocated and whose data still has to be copied in
+struct cp_job {
+    char *local_path;
+    struct ext2_inode *inode;
+    off_t size; // Size of the local file when its blocks were allocated
+    int inode_index;
+    struct ext2_inode *dir; // Directory holding entry
+    struct ext2_dir_entry *entry; // The file's entry, taken out again by cp_undo if the copy fails
+    int err; // errno value if the copy failed
+    struct cp_job *next;
+};
 
-    sb = (struct ext2_super_block *) (disk + BLOCK_SIZE);
-    gd = (struct ext2_group_desc *) (disk + BLOCK_SIZE + sizeof(struct ext2_super_block));
+/*
+ * Undoes the creation of inode_index and its entry in directory dir when its blocks can't all be allocated or
+ * its data can't be copied: frees the blocks mapped so far, then the inode, then takes the entry out again
+ */
+static void cp_undo(struct ext2_inode *dir, struct ext2_dir_entry *entry, int inode_index) {
+    struct ext2_inode *inode = inode_by_index(inode_index);
+    inode_truncate(inode, 0);
+    inode->i_links_count = 0;
+    clear_inode(inode_index);
+    remove_entry(dir, entry);
+}
 
-    struct dir_name *split_dir = split_path(argv[3]);
-    char *parent = split_dir->parent;
-    char *name;
-    struct ext2_dir_entry *folder = get_dir_entry_by_path(argv[3], 1);
-    struct ext2_dir_entry *new_entry;
-    int inode_index;
-    if (folder->file_type != EXT2_FT_DIR) return EEXIST;
-    if (folder == NULL) return ENOENT;
-    if (folder->file_type == EXT2_FT_DIR) { // folder is . entry in directory we will be copying to
-        name = malloc(strlen(argv[2]));
-        strcpy(name, argv[2]);
-        name = strrchr(name, '/'); // Use local filename
-        if (name == NULL) {
-            name = argv[2]; // Handle copying from working directory
-        } else { // Don't necessarily need all the memory alloc'd originally so get a more appropriate amount
-            char *tmp = malloc(strlen(name) + 1);
-            strcpy(tmp, name);
-            free(name);
-            name = tmp;
-        }
-        new_entry = add_new_entry(name, inode_by_index(folder->inode), 0);
-    } else if (folder->file_type == EXT2_FT_REG_FILE) { // folder is the file we will be overwriting
-        char *buffer = malloc(folder->name_len + 1);
-        memcpy(buffer, folder->name, folder->name_len);
-        memset(buffer + folder->name_len, '\0', 1);
-        if (strcmp(buffer, split_dir->name) == 0) return EEXIST; // Returning from main so don't need to free buffer
-        free(buffer);
-        name = split_dir->name;
-        new_entry = folder;
-        clear_entry(folder);
-        folder = get_dir_entry_by_path(parent, 1);
-    } else {
-        return EINVAL;  // invalid filetype
-    }
-    free(split_dir);
-    inode_index = alloc_inode_index();
-    if (inode_index == -1) return ENOSPC;
+/*
+ * Creates the file name in the directory whose . entry is folder for the local file local_path and allocates
+ * its blocks, filling in job
+ * Returns 0 on success or an errno value
+ */
+static int cp_alloc_file(char *local_path, struct ext2_dir_entry *folder, char *name, struct cp_job *job) {
+    if (strlen(name) > EXT2_NAME_LEN) return ENAMETOOLONG;
     // Open the file first to check validity
-    FILE *file = fopen(argv[2], "r");
-    if (file == NULL) return ENOENT;
+    int file = open(local_path, O_RDONLY);
+    if (file == -1) return ENOENT;
     struct stat file_stat;
-    stat(argv[2], &file_stat);
-    int blocks_needed = file_stat.st_size / BLOCK_SIZE;
-    if (blocks_needed == 0) blocks_needed = 1; // Still need a block for an empty file
-    if (blocks_needed > 267 || blocks_needed > sb->s_free_blocks_count) return ENOSPC;
+    fstat(file, &file_stat);
+    close(file);
+    if (S_ISDIR(file_stat.st_mode)) return EISDIR;
+    long long blocks_needed = (file_stat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // The block map must reach the last block and i_blocks, in 512 byte sectors, must hold them all
+    long long max_blocks = EXT2_NDIR_BLOCKS + ADDRS_PER_BLOCK + (long long)ADDRS_PER_BLOCK * ADDRS_PER_BLOCK +
+                           (long long)ADDRS_PER_BLOCK * ADDRS_PER_BLOCK * ADDRS_PER_BLOCK;
+    if (blocks_needed > max_blocks || blocks_needed * DISK_SECS_PER_BLOCK > UINT_MAX) return EFBIG;
+    // Files of 2 GiB or more need the large_file feature, which revision 0 file systems can't have
+    if (file_stat.st_size > INT_MAX && sb->s_rev_level == EXT2_GOOD_OLD_REV) return EFBIG;
+    if (blocks_needed > sb->s_free_blocks_count) return ENOSPC;
+    int inode_index = alloc_inode_index(folder->inode);
+    if (inode_index == -1) return ENOSPC;
+    struct ext2_inode *dir = inode_by_index(folder->inode);
+    struct ext2_dir_entry *new_entry = add_new_entry(name, dir, 0);
+    if (new_entry == NULL) {
+        free_inode_index(inode_index);
+        return ENOSPC;
+    }
 
     struct ext2_inode *inode = inode_by_index(inode_index);
     inode_init(inode, EXT2_S_IFREG);
     new_entry->file_type = EXT2_FT_REG_FILE;
     new_entry->inode = inode_index;
-    inode->i_size = file_stat.st_size;
+    inode->i_size = file_stat.st_size & 0xFFFFFFFF;
+    inode->i_dir_acl = (unsigned long long)file_stat.st_size >> 32;
+    if (file_stat.st_size > INT_MAX) sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
     inode->i_links_count = 1;
-    inode->i_blocks = inode->i_size / 512;
-    // Write to data blocks
-    int new_block;
-    for (int b = 0; b < blocks_needed; b++) {
-        new_block = alloc_data_block();
-        if (new_block == -1) return ENOSPC;         // This shouldn't ever be true if the disk is consistent
-        inode->i_block[b] = new_block;
-        fread(disk + BLOCK_SIZE * new_block, 1, 1024, file);
+    inode->i_blocks = blocks_needed * DISK_SECS_PER_BLOCK;
+    // Allocate data blocks in as few contiguous runs as possible near the inode, one stretch of blocks mapped
+    // through the same indirect block at a time, so each indirect block goes just before the data it maps
+    int goal = goal_block(inode_index);
+    long long b = 0;
+    while (b < blocks_needed) {
+        unsigned int sectors = inode->i_blocks;
+        if (block_map_slot(inode, b, 1, goal) == NULL) { // No space for an indirect block
+            cp_undo(dir, new_entry, inode_index);
+            return ENOSPC;
+        }
+        if (inode->i_blocks != sectors) goal = next_block; // Right after the indirect blocks just allocated
+        int run_len;
+        int stretch = block_map_stretch(b);
+        int run_start = alloc_data_extent(goal, blocks_needed - b < stretch ? blocks_needed - b : stretch, &run_len);
+        if (run_start == -1) { // The free count was enough, but indirect blocks took the rest
+            cp_undo(dir, new_entry, inode_index);
+            return ENOSPC;
+        }
+        journal_block_data(run_start, run_len);
+        for (int i = 0; i < run_len; i++) inode_set_block(inode, b + i, run_start + i); // Mapped, so can't fail
+        b += run_len;
+        goal = run_start + run_len;
     }
+    job->local_path = local_path;
+    job->inode = inode;
+    job->size = file_stat.st_size;
+    job->inode_index = inode_index;
+    job->dir = dir;
+    job->entry = new_entry;
+    job->err = 0;
     return 0;
 }
+
+/*
+ * Creates image_path for the local file local_path and allocates its blocks, filling in job
+ * If image_path is a directory the file keeps its local name, otherwise image_path names the new file
+ * Returns 0 on success or an errno value
+ */
+static int cp_alloc(char *local_path, char *image_path, struct cp_job *job) {
+    struct ext2_dir_entry *folder = get_dir_entry_by_path(image_path, 1);
+    if (folder != NULL) {
+        if (folder->file_type != EXT2_FT_DIR) return EEXIST; // Won't overwrite an existing file
+        // folder is the . entry of the directory we will be copying to, so use the local filename
+        char *name = strrchr(local_path, '/');
+        name = name == NULL ? local_path : name + 1;
+        if (*name == '\0') return EISDIR;
+        if (dir_index_lookup(inode_by_index(folder->inode), name, strlen(name)) != NULL) return EEXIST;
+        return cp_alloc_file(local_path, folder, name, job);
+    }
+    // image_path names the new file
+    struct dir_name *split_dir = split_path(image_path);
+    if (split_dir == NULL) return ENOENT;
+    int err = ENOENT;
+    if (split_dir->name != NULL && !split_dir->trailing_slash) { // With a trailing / the directory doesn't exist
+        folder = get_dir_entry_by_path(split_dir->parent, 1);
+        if (folder != NULL && folder->file_type == EXT2_FT_DIR)
+            err = cp_alloc_file(local_path, folder, split_dir->name, job);
+    }
+    free_dir_name(split_dir);
+    return err;
+}
+
+/*
+ * Copies the data of the cp_job arg into the blocks cp_alloc() allocated for it, one contiguous run at a time
+ * Sets the job's err on failure, after which the caller undoes the file with cp_undo on the allocating thread
+ */
+static void cp_copy(void *arg) {
+    struct cp_job *job = arg;
+    if (job->size == 0) return;
+    int file = open(job->local_path, O_RDONLY);
+    if (file == -1) {
+        job->err = errno;
+        return;
+    }
+    struct stat file_stat;
+    fstat(file, &file_stat);
+    if (file_stat.st_size < job->size) { // Truncated since it was allocated, so the mapping would fault
+        job->err = EIO;
+        close(file);
+        return;
+    }
+    // Map the file so each run of blocks is filled with a single memcpy, falling back to read if it can't be mapped
+    unsigned char *src = mmap(NULL, job->size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (src == MAP_FAILED) src = NULL;
+    else madvise(src, job->size, MADV_SEQUENTIAL);
+
+    struct block_iter it;
+    unsigned int block;
+    int run_len;
+    off_t offset = 0;
+    block_iter_init(&it, job->inode);
+    while (block_iter_next_run(&it, &block, &run_len)) { // Copy each run at once
+        size_t len = (size_t)run_len * BLOCK_SIZE;
+        if (offset + len > job->size) len = job->size - offset;
+        if (copy_to_extent(file, src, offset, block, len) == -1) {
+            job->err = EIO;
+            break;
+        }
+        offset += len;
+    }
+    if (src != NULL) munmap(src, job->size);
+    close(file);
+}
+
+/*
+ * Copies the local file local_path to image_path on the open image
+ * If image_path is a directory the file keeps its local name, otherwise image_path names the new file
+ * Returns 0 on success or an errno value
+ */
+int ext2_cp(char *local_path, char *image_path) {
+    struct cp_job job;
+    int err = cp_alloc(local_path, image_path, &job);
+    if (err != 0) return err;
+    cp_copy(&job);
+    if (job.err != 0) cp_undo(job.dir, job.entry, job.inode_index);
+    return job.err;
+}
+
+// Returns dir/name in a new string
+static char *cp_join(const char *dir, const char *name) {
+    int dir_len = strlen(dir);
+    while (dir_len > 0 && dir[dir_len - 1] == '/') dir_len--;
+    char *path = malloc(dir_len + strlen(name) + 2);
+    if (path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(path, "%.*s/%s", dir_len, dir, name);
+    return path;
+}
+
+/*
+ * Copies the entries of the local directory local_dir into the existing directory image_dir
+ * Files are allocated here and their copies handed to pool, or run inline if pool is NULL; each file's job
+ * is pushed onto *jobs. Errors are reported and skipped
+ * Returns 0 if everything was copied or the errno value of the first failure
+ */
+static int cp_dir(char *local_dir, char *image_dir, struct task_pool *pool, struct cp_job **jobs) {
+    struct dirent **names;
+    int count = scandir(local_dir, &names, NULL, alphasort);
+    if (count == -1) {
+        int err = errno;
+        fprintf(stderr, "%s: %s\n", local_dir, strerror(err));
+        return err;
+    }
+    int first_err = 0;
+    for (int i = 0; i < count; i++) {
+        char *name = names[i]->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            free(names[i]);
+            continue;
+        }
+        char *local_path = cp_join(local_dir, name);
+        char *image_path = cp_join(image_dir, name);
+        free(names[i]);
+        int err = 0;
+        struct stat st;
+        if (lstat(local_path, &st) == -1) {
+            err = errno;
+            fprintf(stderr, "%s: %s\n", local_path, strerror(err));
+            free(local_path);
+        } else if (S_ISDIR(st.st_mode)) {
+            err = make_dir(image_path);
+            if (err == 0) err = cp_dir(local_path, image_path, pool, jobs);
+            else fprintf(stderr, "%s: %s\n", image_path, strerror(err));
+            free(local_path);
+        } else if (S_ISREG(st.st_mode)) {
+            struct cp_job *job = malloc(sizeof(struct cp_job));
+            if (job == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            err = cp_alloc(local_path, image_path, job);
+            if (err == 0) {
+                job->next = *jobs; // The job keeps local_path until its copy is done
+                *jobs = job;
+                if (pool != NULL) pool_submit(pool, cp_copy, job);
+                else cp_copy(job);
+            } else {
+                fprintf(stderr, "%s: %s\n", image_path, strerror(err));
+                free(job);
+                free(local_path);
+            }
+        } else {
+            fprintf(stderr, "%s: skipped, not a regular file or directory\n", local_path);
+            free(local_path);
+        }
+        free(image_path);
+        if (first_err == 0) first_err = err;
+        if (journal_end_op()) { // The pool's copies must be written before the commit flushes them
+            if (pool != NULL) pool_wait(pool);
+            journal_commit();
+        }
+    }
+    free(names);
+    return first_err;
+}
+
+/*
+ * Copies the local directory tree local_dir to image_path on the open image
+ * If image_path is a directory the tree is copied into it under its local name, otherwise image_path names the
+ * new directory. Directories and inodes are created and blocks allocated on the calling thread, and the file
+ * data is copied on pool, or inline if pool is NULL
+ * Returns 0 if everything was copied or the errno value of the first failure
+ */
+int ext2_cp_tree(char *local_dir, char *image_path, struct task_pool *pool) {
+    struct stat st;
+    if (stat(local_dir, &st) == -1) return ENOENT;
+    if (!S_ISDIR(st.st_mode)) return ENOTDIR;
+    char *dest;
+    struct ext2_dir_entry *folder = get_dir_entry_by_path(image_path, 0);
+    if (folder != NULL) {
+        if (folder->file_type != EXT2_FT_DIR) return EEXIST;
+        // Copy into the existing directory under the local directory's name
+        char *local = strdup(local_dir);
+        int len = strlen(local);
+        while (len > 1 && local[len - 1] == '/') local[--len] = '\0';
+        char *name = strrchr(local, '/');
+        name = name == NULL ? local : name + 1;
+        if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            free(local);
+            return EINVAL;
+        }
+        dest = cp_join(image_path, name);
+        free(local);
+    } else {
+        dest = strdup(image_path);
+    }
+    int err = make_dir(dest);
+    if (err != 0) {
+        free(dest);
+        return err;
+    }
+    struct cp_job *jobs = NULL;
+    err = cp_dir(local_dir, dest, pool, &jobs);
+    if (pool != NULL) pool_wait(pool);
+    while (jobs != NULL) {
+        struct cp_job *job = jobs;
+        jobs = job->next;
+        if (job->err != 0) { // Don't leave the file behind with its blocks unfilled
+            fprintf(stderr, "%s: %s\n", job->local_path, strerror(job->err));
+            cp_undo(job->dir, job->entry, job->inode_index);
+            if (err == 0) err = job->err;
+        }
+        free(job->local_path);
+        free(job);
+    }
+    free(dest);
+    return err;
+}
+
+#ifndef EXT2_BATCH
+int main(int argc, char **argv) {
+    int recursive = 0;
+    int threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        if (opt == 'r') {
+            recursive = 1;
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            threads = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-r] [-j threads] <image file name> <path on local system> <absolute path on virtual disk>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 3) {
+        fprintf(stderr, "Usage: %s [-r] [-j threads] <image file name> <path on local system> <absolute path on virtual disk>\n", argv[0]);
+        exit(1);
+    }
+    open_image(argv[optind]);
+    int err;
+    if (recursive) {
+        struct task_pool *pool = NULL;
+        if (threads > 1) {
+            pool = pool_create(threads);
+            if (pool == NULL) {
+                fprintf(stderr, "Couldn't start %d threads\n", threads);
+                exit(1);
+            }
+        }
+        err = ext2_cp_tree(argv[optind + 1], argv[optind + 2], pool);
+        if (pool != NULL) pool_destroy(pool);
+    } else {
+        err = ext2_cp(argv[optind + 1], argv[optind + 2]);
+    }
+    close_image();
+    return err;
+}
+#endif
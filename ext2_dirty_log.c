@@ -0,0 +1,102 @@
+/*
+ * Dirty log
+ * The tools that change an image record the groups, inodes and directories they touch in a sidecar file next to
+ * it, <image>.dirty, so that ext2_checker --incremental only has to check those. Each run appends
+ *   begin
+ *   group <group>   for each group whose bitmaps or counters changed
+ *   inode <inode>   for each inode allocated, freed or linked
+ *   dir <inode>     for each directory whose entries changed
+ *   end
+ * "begin" is written before the run's first change and "end" once its changes have been written back, so a run
+ * that didn't finish leaves a log the checker won't trust. ext2_checker removes the log once it has checked the image
+ */
+
+struct dirty_log {
+    int disabled;           // Nonzero if changes aren't logged, as in ext2_checker
+    FILE *file;             // The log, open once this run has made its first change
+    unsigned char *groups;  // Bit group is set once group has been logged
+    unsigned char *inodes;  // Bit inode - 1 is set once inode has been logged
+    unsigned char *dirs;    // Bit inode - 1 is set once directory inode has been logged
+};
+
+struct dirty_log dirty_log;
+
+/*
+ * Returns the path of the dirty log of the image at path in a new string
+ */
+char *dirty_log_path(const char *path) {
+    char *log_path = malloc(strlen(path) + sizeof(".dirty"));
+    if (log_path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(log_path, "%s.dirty", path);
+    return log_path;
+}
+
+/*
+ * Opens the log and writes "begin" the first time this run changes the image
+ * Returns 0 iff changes aren't being logged
+ */
+static int dirty_log_start() {
+    if (dirty_log.disabled) return 0;
+    if (dirty_log.file != NULL) return 1;
+    char *log_path = dirty_log_path(image_path);
+    dirty_log.file = fopen(log_path, "a");
+    if (dirty_log.file == NULL) { // Carry on with the change, but the log can't be trusted for this image any more
+        fprintf(stderr, "%s: %s, ext2_checker --incremental will miss this run's changes\n", log_path, strerror(errno));
+        free(log_path);
+        dirty_log.disabled = 1;
+        return 0;
+    }
+    free(log_path);
+    dirty_log.groups = calloc((group_count + 7) / 8, 1);
+    dirty_log.inodes = calloc((sb->s_inodes_count + 7) / 8, 1);
+    dirty_log.dirs = calloc((sb->s_inodes_count + 7) / 8, 1);
+    if (dirty_log.groups == NULL || dirty_log.inodes == NULL || dirty_log.dirs == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    fprintf(dirty_log.file, "begin\n");
+    fflush(dirty_log.file);
+    return 1;
+}
+
+// Logs that the bitmaps or counters of group changed
+void dirty_log_group(int group) {
+    if (group >= 0 && group < group_count && dirty_log_start()) bitmap_set(dirty_log.groups, group);
+}
+
+// Logs that inode_index was allocated, freed or linked
+void dirty_log_inode(int inode_index) {
+    if (inode_is_valid(inode_index) && dirty_log_start()) bitmap_set(dirty_log.inodes, inode_index - 1);
+}
+
+// Logs that the entries of directory dir changed
+void dirty_log_dir(struct ext2_inode *dir) {
+    if (!dirty_log_start()) return;
+    int inode_index = inode_index_of(dir);
+    if (inode_index != -1) bitmap_set(dirty_log.dirs, inode_index - 1);
+}
+
+// Writes out the bits set in bitmap of nbits bits as lines "<kind> <bit + first>"
+static void dirty_log_write(const char *kind, unsigned char *bitmap, int nbits, int first) {
+    for (int bit = bitmap_find_set(bitmap, 0, nbits); bit != -1; bit = bitmap_find_set(bitmap, bit + 1, nbits))
+        fprintf(dirty_log.file, "%s %d\n", kind, bit + first);
+}
+
+/*
+ * Writes what this run changed to the log and ends it, once the changes are in the image
+ */
+void dirty_log_close() {
+    if (dirty_log.file == NULL) return;
+    dirty_log_write("group", dirty_log.groups, group_count, 0);
+    dirty_log_write("inode", dirty_log.inodes, sb->s_inodes_count, 1);
+    dirty_log_write("dir", dirty_log.dirs, sb->s_inodes_count, 1);
+    fprintf(dirty_log.file, "end\n");
+    if (fclose(dirty_log.file) == EOF) perror("dirty log");
+    dirty_log.file = NULL;
+    free(dirty_log.groups);
+    free(dirty_log.inodes);
+    free(dirty_log.dirs);
+}
@@ -1,105 +1,388 @@
-#include <stdio.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include "ext2.h"
+#include "ext2_utils.c"
 
-unsigned char *disk;
+/*
+ * Dumps the image's metadata in one pass over the inode table, through a large stdout buffer
+ * Formats:
+ *   human   the original text layout. Directory blocks are collected in memory while inodes are printed
+ *           and written after them, so the inodes are still only visited once
+ *   json    one JSON object per line, each with a "type" of super, group, bitmap, inode or dirent
+ *   binary  the magic "E2DB" and a 32 bit version, then records of an 8 bit kind, 3 zero bytes and a 32 bit
+ *           payload length, followed by the payload. Every integer is little-endian
+ *             1 super   inodes, blocks, block size, groups (32 bits each)
+ *             2 group   group, block bitmap, inode bitmap, inode table (32 bits each),
+ *                       free blocks, free inodes, used dirs, 0 (16 bits each)
+ *             3 bitmap  0 for blocks or 1 for inodes, group, bit count (32 bits each), then the bitmap bytes
+ *             4 inode   inode, in use, i_mode, i_links_count, i_size, i_blocks, block count (32 bits each),
+ *                       then the block numbers (32 bits each, 0 for a hole)
+ *             5 dirent  directory inode, block, inode (32 bits each), rec_len (16 bits), name_len,
+ *                       file_type (8 bits each), then the name
+ *             6 ranges  0 for blocks or 1 for inodes, group, run count (32 bits each), then the first
+ *                       and last number and 1 if used or 0 if free of each run (32 bits each)
+ *             7 extents group, largest free run (32 bits each), then the number of free runs of
+ *                       2^b to 2^(b+1) - 1 blocks for b from 0 to 31 (32 bits each)
+ * Filters pick the inodes dumped: -i FIRST[-LAST] limits them to a range, -d to directories and -u to inodes
+ * that are in use. Human output only ever lists inodes in use. Reserved inodes other than the root are only
+ * dumped when -i names them
+ * With -r the bitmaps are shown as runs of used and free blocks or inodes instead of bit by bit, followed by
+ * a histogram of each group's free block runs by size, so fragmentation can be read at a glance
+ */
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
-        exit(1);
+#define DUMP_HUMAN 0
+#define DUMP_JSON 1
+#define DUMP_BINARY 2
+
+#define DUMP_BUFFER_SIZE (1 << 20)
+
+int format = DUMP_HUMAN;
+FILE *dir_out; // Where human output collects the directory blocks section
+
+// Writes v as little-endian 32 bits
+static void put_u32(unsigned int v) {
+    unsigned char b[4] = { v, v >> 8, v >> 16, v >> 24 };
+    fwrite(b, 1, 4, stdout);
+}
+
+// Writes v as little-endian 16 bits
+static void put_u16(unsigned short v) {
+    unsigned char b[2] = { v, v >> 8 };
+    fwrite(b, 1, 2, stdout);
+}
+
+// Starts a binary record of kind kind with len bytes of payload
+static void put_record(int kind, unsigned int len) {
+    unsigned char b[4] = { kind, 0, 0, 0 };
+    fwrite(b, 1, 4, stdout);
+    put_u32(len);
+}
+
+// Writes the len bytes of name as the contents of a JSON string
+static void put_json_string(const char *name, int len) {
+    for (int i = 0; i < len; i++) {
+        unsigned char c = name[i];
+        if (c == '"' || c == '\\') printf("\\%c", c);
+        else if (c < 0x20) printf("\\u%04x", c);
+        else putchar(c);
+    }
+}
+
+static void dump_super() {
+    if (format == DUMP_HUMAN) {
+        printf("Inodes: %d\n", sb->s_inodes_count);
+        printf("Blocks: %d\n", sb->s_blocks_count);
+    } else if (format == DUMP_JSON) {
+        printf("{\"type\":\"super\",\"inodes\":%u,\"blocks\":%u,\"block_size\":%d,\"groups\":%d}\n",
+               sb->s_inodes_count, sb->s_blocks_count, BLOCK_SIZE, group_count);
+    } else {
+        put_record(1, 16);
+        put_u32(sb->s_inodes_count);
+        put_u32(sb->s_blocks_count);
+        put_u32(BLOCK_SIZE);
+        put_u32(group_count);
     }
-    int fd = open(argv[1], O_RDWR);
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
+}
+
+static void dump_group(int group) {
+    struct ext2_group_desc *desc = group_desc(group);
+    if (format == DUMP_HUMAN) {
+        printf("Block group:\n");
+        printf("    block bitmap: %d\n", desc->bg_block_bitmap);
+        printf("    inode bitmap: %d\n", desc->bg_inode_bitmap);
+        printf("    inode table: %d\n", desc->bg_inode_table);
+        printf("    free blocks: %d\n", desc->bg_free_blocks_count);
+        printf("    free inodes: %d\n", desc->bg_free_inodes_count);
+        printf("    used_dirs: %d\n", desc->bg_used_dirs_count);
+    } else if (format == DUMP_JSON) {
+        printf("{\"type\":\"group\",\"group\":%d,\"block_bitmap\":%u,\"inode_bitmap\":%u,\"inode_table\":%u,"
+               "\"free_blocks\":%u,\"free_inodes\":%u,\"used_dirs\":%u}\n",
+               group, desc->bg_block_bitmap, desc->bg_inode_bitmap, desc->bg_inode_table,
+               desc->bg_free_blocks_count, desc->bg_free_inodes_count, desc->bg_used_dirs_count);
+    } else {
+        put_record(2, 24);
+        put_u32(group);
+        put_u32(desc->bg_block_bitmap);
+        put_u32(desc->bg_inode_bitmap);
+        put_u32(desc->bg_inode_table);
+        put_u16(desc->bg_free_blocks_count);
+        put_u16(desc->bg_free_inodes_count);
+        put_u16(desc->bg_used_dirs_count);
+        put_u16(0);
     }
+}
 
-    struct ext2_super_block *sb = (struct ext2_super_block *) (disk + 1024);
-    printf("Inodes: %d\n", sb->s_inodes_count);
-    printf("Blocks: %d\n", sb->s_blocks_count);
-    struct ext2_group_desc *gd = (struct ext2_group_desc *) (disk + EXT2_BLOCK_SIZE + sizeof(struct ext2_super_block));
-    printf("Block group:\n");
-    printf("    block bitmap: %d\n", gd->bg_block_bitmap);
-    printf("    inode bitmap: %d\n", gd->bg_inode_bitmap);
-    printf("    inode table: %d\n", gd->bg_inode_table);
-    printf("    free blocks: %d\n", sb->s_free_blocks_count);
-    printf("    free inodes: %d\n", sb->s_free_inodes_count);
-    printf("    used_dirs: %d\n", gd->bg_used_dirs_count);
-    printf("Block bitmap: ");
-    for (int byte = 0; byte < sb->s_blocks_count / 8; byte++) {
-        for (int bit = 0; bit < 8; bit++) {
-            printf("%d", (disk[EXT2_BLOCK_SIZE * gd->bg_block_bitmap + byte] >> bit) & 1);
+/*
+ * Dumps the nbits bit bitmap of group, which tracks inodes if inodes != 0 and blocks otherwise
+ * Human output prints every bit of the last byte, even past nbits
+ */
+static void dump_bitmap(unsigned char *bitmap, int group, int nbits, int inodes) {
+    if (format == DUMP_HUMAN) {
+        for (int byte = 0; byte < (nbits + 7) / 8; byte++) {
+            for (int bit = 0; bit < 8; bit++) putchar('0' + ((bitmap[byte] >> bit) & 1));
+            putchar(' ');
         }
-        printf(" ");
+    } else if (format == DUMP_JSON) {
+        printf("{\"type\":\"bitmap\",\"kind\":\"%s\",\"group\":%d,\"bits\":%d,\"hex\":\"", inodes ? "inode" : "block", group, nbits);
+        for (int byte = 0; byte < (nbits + 7) / 8; byte++) printf("%02x", bitmap[byte]);
+        printf("\"}\n");
+    } else {
+        put_record(3, 12 + (nbits + 7) / 8);
+        put_u32(inodes);
+        put_u32(group);
+        put_u32(nbits);
+        fwrite(bitmap, 1, (nbits + 7) / 8, stdout);
+    }
+}
+
+/*
+ * Dumps the nbits bit bitmap of group as runs of used and free bits, found with word-level scans
+ * first is the block or inode number of bit 0
+ */
+static void dump_bitmap_ranges(unsigned char *bitmap, int group, int nbits, int inodes, unsigned int first) {
+    int runs = 0;
+    for (int bit = 0; bit < nbits; bit += bitmap_run_length(bitmap, bit, nbits)) runs++;
+    if (format == DUMP_HUMAN) printf("    group %d:", group);
+    else if (format == DUMP_JSON) printf("{\"type\":\"ranges\",\"kind\":\"%s\",\"group\":%d,\"runs\":[", inodes ? "inode" : "block", group);
+    else {
+        put_record(6, 12 + 12 * runs);
+        put_u32(inodes);
+        put_u32(group);
+        put_u32(runs);
     }
-    printf("\nInode bitmap: ");
-    for (int byte = 0; byte < sb->s_inodes_count / 8; byte++) {
-        for (int bit = 0; bit < 8; bit++) {
-            printf("%d", (disk[EXT2_BLOCK_SIZE * gd->bg_inode_bitmap + byte] >> bit) & 1);
+    for (int bit = 0, i = 0; bit < nbits; i++) {
+        int len = bitmap_run_length(bitmap, bit, nbits);
+        int used = bitmap_test(bitmap, bit);
+        if (format == DUMP_HUMAN && len == 1) printf("%s %s %u", i ? "," : "", used ? "used" : "free", first + bit);
+        else if (format == DUMP_HUMAN) printf("%s %s %u-%u", i ? "," : "", used ? "used" : "free", first + bit, first + bit + len - 1);
+        else if (format == DUMP_JSON) printf("%s[\"%s\",%u,%u]", i ? "," : "", used ? "used" : "free", first + bit, first + bit + len - 1);
+        else {
+            put_u32(first + bit);
+            put_u32(first + bit + len - 1);
+            put_u32(used);
         }
-        printf(" ");
+        bit += len;
     }
-    printf("\n\nInodes:\n");
-    for (int byte = 0; byte < sb->s_inodes_count / 8; byte++) {
-        for (int bit = 0; bit < 8; bit++) {
-            int node_no = 8 * byte + bit + 1;             // Add 1 since nodes are indexed from 1
-            if (node_no < EXT2_ROOT_INO || (node_no != EXT2_ROOT_INO && node_no <= EXT2_GOOD_OLD_FIRST_INO)) continue;             // Skip reserved inodes
-            // Check if this inode is in use by the inode bitmap and print its information if it is
-            if ((disk[EXT2_BLOCK_SIZE * gd->bg_inode_bitmap + byte] >> bit) & 1) {
-                struct ext2_inode *inode = (struct ext2_inode*) (disk + (EXT2_BLOCK_SIZE * gd->bg_inode_table + sb->s_inode_size * (node_no - 1)));
-                char mode;
-                if (inode->i_mode & EXT2_S_IFDIR) mode = 'd';
-                else if (inode->i_mode & EXT2_S_IFREG) mode = 'f';
-                else mode = '0';
-                printf("[%d] type: %c size: %d links: %d blocks: %d\n", node_no, mode, inode->i_size, inode->i_links_count, inode->i_blocks);
-                printf("[%d] Blocks: ", node_no);
-                for (int i = 0; i < inode->i_blocks / (2 << sb->s_blocks_count); i++) {
-                    printf(" %d", inode->i_block[i]);
-                }
-                printf("\n");
-            }
+    if (format == DUMP_HUMAN) printf("\n");
+    else if (format == DUMP_JSON) printf("]}\n");
+}
+
+#define EXTENT_BUCKETS 32 // Bucket b counts free extents of 2^b to 2^(b+1) - 1 blocks
+
+/*
+ * Dumps a histogram of the sizes of group's runs of free blocks, in power of 2 buckets
+ */
+static void dump_free_extents(int group) {
+    unsigned int hist[EXTENT_BUCKETS] = {0};
+    int largest = 0;
+    unsigned char *bitmap = block_bitmap(group);
+    int nbits = group_block_count(group);
+    for (int bit = bitmap_find_zero(bitmap, 0, nbits); bit != -1; ) {
+        int len = bitmap_run_length(bitmap, bit, nbits);
+        hist[31 - __builtin_clz(len)]++;
+        if (len > largest) largest = len;
+        bit = bit + len < nbits ? bitmap_find_zero(bitmap, bit + len, nbits) : -1;
+    }
+    if (format == DUMP_HUMAN) {
+        printf("    group %d:", group);
+        for (int b = 0, i = 0; b < EXTENT_BUCKETS; b++) {
+            if (hist[b] == 0) continue;
+            if (b == 0) printf("%s 1: %u", i++ ? "," : "", hist[b]);
+            else printf("%s %u-%u: %u", i++ ? "," : "", 1u << b, (2u << b) - 1, hist[b]);
         }
+        printf(" (largest %d)\n", largest);
+    } else if (format == DUMP_JSON) {
+        printf("{\"type\":\"free_extents\",\"group\":%d,\"largest\":%d,\"histogram\":[", group, largest);
+        for (int b = 0, i = 0; b < EXTENT_BUCKETS; b++)
+            if (hist[b] != 0) printf("%s[%u,%u]", i++ ? "," : "", 1u << b, hist[b]);
+        printf("]}\n");
+    } else {
+        put_record(7, 8 + 4 * EXTENT_BUCKETS);
+        put_u32(group);
+        put_u32(largest);
+        for (int b = 0; b < EXTENT_BUCKETS; b++) put_u32(hist[b]);
     }
-    printf("\nDirectory Blocks:\n");
-    for (int byte = 0; byte < sb->s_inodes_count / 8; byte++) {
-        for (int bit = 0; bit < 8; bit++) {
-            int node_no = 8 * byte + bit + 1;             // Add 1 since nodes are indexed from 1
-            if (node_no < EXT2_ROOT_INO || (node_no != EXT2_ROOT_INO && node_no <= EXT2_GOOD_OLD_FIRST_INO)) continue;             // Skip reserved inodes
-            // Check if this inode is in use by the inode bitmap and print its information if it is
-            if ((disk[EXT2_BLOCK_SIZE * gd->bg_inode_bitmap + byte] >> bit) & 1) {
-                struct ext2_inode *inode = (struct ext2_inode*) (disk + (EXT2_BLOCK_SIZE * gd->bg_inode_table + sb->s_inode_size * (node_no - 1)));
-                if (!(inode->i_mode & EXT2_S_IFDIR)) continue;                 // Skip non-directory inodes
-                for (int i = 0; i < inode->i_blocks / (2 << sb->s_blocks_count); i++) {
-                    printf("   DIR BLOCK NUM: %d (for inode %d)", inode->i_block[i], node_no);
-                    struct ext2_dir_entry *dir = (struct ext2_dir_entry*) (disk + EXT2_BLOCK_SIZE * inode->i_block[i]);
-                    int rec_sum = 0; // Sum of rec_len printed already in this block, used to find when we are at the end of the block
-                    char mode = '0';
-                    while (rec_sum < 1024) {
-                        switch (dir->file_type) {
-                            case EXT2_FT_REG_FILE:
-                                mode = 'f';
-                                break;
-
-                            case EXT2_FT_DIR:
-                                mode = 'd';
-                                break;
-                        }
-                        printf("\nInode: %d rec_len: %d name_len: %d type= %c name=%.*s", dir->inode, dir->rec_len, dir->name_len, mode, dir->name_len, dir->name);
-                        rec_sum += dir->rec_len;
-                        dir = (struct ext2_dir_entry*) (((char *) dir) + dir->rec_len);
-                    }
-                }
-                printf("\n");
+}
+
+static void dump_inode(int node_no, struct ext2_inode *inode, int used) {
+    struct block_iter it;
+    unsigned int block;
+    block_iter_init(&it, inode);
+    if (format == DUMP_HUMAN) {
+        char mode;
+        if (inode->i_mode & EXT2_S_IFDIR) mode = 'd';
+        else if (inode->i_mode & EXT2_S_IFREG) mode = 'f';
+        else mode = '0';
+        printf("[%d] type: %c size: %d links: %d blocks: %d\n", node_no, mode, inode->i_size, inode->i_links_count, inode->i_blocks);
+        printf("[%d] Blocks: ", node_no);
+        while (block_iter_next(&it, &block)) printf(" %d", block);
+        printf("\n");
+    } else if (format == DUMP_JSON) {
+        const char *kind;
+        switch (inode->i_mode & EXT2_S_IFMT) {
+            case EXT2_S_IFDIR: kind = "dir"; break;
+            case EXT2_S_IFREG: kind = "file"; break;
+            case EXT2_S_IFLNK: kind = "symlink"; break;
+            default: kind = "other"; break;
+        }
+        printf("{\"type\":\"inode\",\"inode\":%d,\"used\":%s,\"kind\":\"%s\",\"mode\":%u,\"size\":%u,\"links\":%u,\"i_blocks\":%u,\"blocks\":[",
+               node_no, used ? "true" : "false", kind, inode->i_mode, inode->i_size, inode->i_links_count, inode->i_blocks);
+        for (int i = 0; block_iter_next(&it, &block); i++) printf(i ? ",%u" : "%u", block);
+        printf("]}\n");
+    } else {
+        int count = it.count;
+        put_record(4, 28 + 4 * count);
+        put_u32(node_no);
+        put_u32(used);
+        put_u32(inode->i_mode);
+        put_u32(inode->i_links_count);
+        put_u32(inode->i_size);
+        put_u32(inode->i_blocks);
+        put_u32(count);
+        while (block_iter_next(&it, &block)) put_u32(block);
+    }
+}
+
+// Dumps the entries of block, one of the blocks of directory inode node_no
+SPECIALIZED void dump_dir_block_sized(int node_no, unsigned int block, const int block_size) {
+    if (format == DUMP_HUMAN) fprintf(dir_out, "   DIR BLOCK NUM: %d (for inode %d)", block, node_no);
+    struct ext2_dir_entry *dir = (struct ext2_dir_entry*)block_ptr(block);
+    int rec_sum = 0; // Sum of rec_len printed already in this block, used to find when we are at the end of the block
+    char mode = '0';
+    while (rec_sum < BLOCK_SIZE && dir->rec_len != 0) {
+        if (format == DUMP_HUMAN) {
+            switch (dir->file_type) {
+                case EXT2_FT_REG_FILE:
+                    mode = 'f';
+                    break;
+
+                case EXT2_FT_DIR:
+                    mode = 'd';
+                    break;
             }
+            fprintf(dir_out, "\nInode: %d rec_len: %d name_len: %d type= %c name=%.*s", dir->inode, dir->rec_len, dir->name_len, mode, dir->name_len, dir->name);
+        } else if (format == DUMP_JSON) {
+            printf("{\"type\":\"dirent\",\"dir\":%d,\"block\":%u,\"inode\":%u,\"rec_len\":%u,\"name_len\":%u,\"file_type\":%u,\"name\":\"",
+                   node_no, block, dir->inode, dir->rec_len, dir->name_len, dir->file_type);
+            put_json_string(dir->name, dir->name_len);
+            printf("\"}\n");
+        } else {
+            put_record(5, 16 + dir->name_len);
+            put_u32(node_no);
+            put_u32(block);
+            put_u32(dir->inode);
+            put_u16(dir->rec_len);
+            putchar(dir->name_len);
+            putchar(dir->file_type);
+            fwrite(dir->name, 1, dir->name_len, stdout);
         }
+        rec_sum += dir->rec_len;
+        dir = (struct ext2_dir_entry*) (((char *) dir) + dir->rec_len);
     }
+}
+
+static void dump_dir_block(int node_no, unsigned int block) {
+    BLOCK_SIZE_SPECIALIZE(dump_dir_block_sized, node_no, block);
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-f human|json|binary] [-i first[-last]] [-d] [-u] [-r] <image file name>\n", name);
+    exit(1);
+}
 
+int main(int argc, char **argv) {
+    int first = 1;
+    int last = -1;
+    int reserved = 0; // Nonzero to dump reserved inodes too
+    int dirs_only = 0;
+    int used_only = 0;
+    int ranges = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:i:dur")) != -1) {
+        if (opt == 'f' && strcmp(optarg, "human") == 0) {
+            format = DUMP_HUMAN;
+        } else if (opt == 'f' && strcmp(optarg, "json") == 0) {
+            format = DUMP_JSON;
+        } else if (opt == 'f' && strcmp(optarg, "binary") == 0) {
+            format = DUMP_BINARY;
+        } else if (opt == 'i') {
+            char *end;
+            first = strtol(optarg, &end, 10);
+            if (*end == '-') last = strtol(end + 1, &end, 10);
+            else last = first;
+            if (*end != '\0' || first < 1 || last < first) usage(argv[0]);
+            reserved = 1;
+        } else if (opt == 'd') {
+            dirs_only = 1;
+        } else if (opt == 'u') {
+            used_only = 1;
+        } else if (opt == 'r') {
+            ranges = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+    open_image(argv[optind]);
+    if (format == DUMP_HUMAN) used_only = 1;
+    if (last == -1 || last > sb->s_inodes_count) last = sb->s_inodes_count;
+
+    setvbuf(stdout, NULL, _IOFBF, DUMP_BUFFER_SIZE);
+    char *dir_text = NULL;
+    size_t dir_len = 0;
+    if (format == DUMP_HUMAN) {
+        dir_out = open_memstream(&dir_text, &dir_len);
+        if (dir_out == NULL) {
+            perror("open_memstream");
+            exit(1);
+        }
+    } else if (format == DUMP_BINARY) {
+        fwrite("E2DB", 1, 4, stdout);
+        put_u32(1);
+    }
+
+    dump_super();
+    for (int group = 0; group < group_count; group++) dump_group(group);
+    if (ranges) {
+        if (format == DUMP_HUMAN) printf("Block bitmap:\n");
+        for (int group = 0; group < group_count; group++)
+            dump_bitmap_ranges(block_bitmap(group), group, group_block_count(group), 0, group_first_block(group));
+        if (format == DUMP_HUMAN) printf("Inode bitmap:\n");
+        for (int group = 0; group < group_count; group++)
+            dump_bitmap_ranges(inode_bitmap(group), group, sb->s_inodes_per_group, 1, group * sb->s_inodes_per_group + 1);
+        if (format == DUMP_HUMAN) printf("Free block extents:\n");
+        for (int group = 0; group < group_count; group++) dump_free_extents(group);
+        if (format == DUMP_HUMAN) printf("\nInodes:\n");
+    } else {
+        if (format == DUMP_HUMAN) printf("Block bitmap: ");
+        for (int group = 0; group < group_count; group++)
+            dump_bitmap(block_bitmap(group), group, group_block_count(group), 0);
+        if (format == DUMP_HUMAN) printf("\nInode bitmap: ");
+        for (int group = 0; group < group_count; group++)
+            dump_bitmap(inode_bitmap(group), group, sb->s_inodes_per_group, 1);
+        if (format == DUMP_HUMAN) printf("\n\nInodes:\n");
+    }
+    for (int node_no = first; node_no <= last; node_no++) {
+        if (!reserved && node_no != EXT2_ROOT_INO && node_no < EXT2_GOOD_OLD_FIRST_INO) continue; // Skip reserved inodes
+        int used = inode_is_allocated(node_no);
+        if (used_only && !used) continue;
+        struct ext2_inode *inode = inode_by_index(node_no);
+        int is_dir = format == DUMP_HUMAN ? (inode->i_mode & EXT2_S_IFDIR) != 0 : (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+        if (dirs_only && !is_dir) continue;
+        dump_inode(node_no, inode, used);
+        if (!is_dir || !used) continue;
+        struct block_iter it;
+        unsigned int block;
+        block_iter_init(&it, inode);
+        while (block_iter_next(&it, &block)) {
+            if (!block_is_valid(block)) continue;
+            dump_dir_block(node_no, block);
+        }
+        if (format == DUMP_HUMAN) fputc('\n', dir_out);
+    }
+    if (format == DUMP_HUMAN) {
+        fclose(dir_out);
+        printf("\nDirectory Blocks:\n");
+        fwrite(dir_text, 1, dir_len, stdout);
+        free(dir_text);
+    }
+    fflush(stdout);
     return 0;
 }
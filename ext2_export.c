@@ -0,0 +1,256 @@
+#include <sys/stat.h>
+#include "ext2_utils.c"
+#include "ext2_pool.c"
+
+/*
+ * Copies files out of the image
+ * A file's data is written with one write per run of contiguous blocks, straight from the image mapping.
+ * With -r a directory tree is exported: directories are created and walked on the main thread, and the files
+ * are written on the pool
+ */
+
+// A file that still has to be written out of the image
+struct export_job {
+    char *local_path;
+    struct ext2_inode *inode;
+    int err; // errno value if the write failed
+    struct export_job *next;
+};
+
+// Writes all len bytes of buf to fd. Returns 0 on success or an errno value
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return errno;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Writes the contents of inode to fd, one write per run of contiguous blocks
+ * Returns 0 on success or an errno value
+ */
+int export_inode(struct ext2_inode *inode, int fd) {
+    static const unsigned char zero[EXT2_MAX_BLOCK_SIZE];
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && inode->i_blocks == 0) { // Fast symlink, target is in i_block
+        if (inode->i_size > sizeof(inode->i_block)) return EIO;
+        return write_all(fd, (unsigned char *)inode->i_block, inode->i_size);
+    }
+    struct block_iter it;
+    unsigned int block;
+    int run_len;
+    size_t remaining = inode->i_size;
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) remaining |= (size_t)inode->i_dir_acl << 32; // large_file
+    block_iter_init(&it, inode);
+    while (remaining > 0 && block_iter_next_run(&it, &block, &run_len)) {
+        size_t len = (size_t)run_len * BLOCK_SIZE;
+        if (len > remaining) len = remaining;
+        int err;
+        if (block == 0) { // Holes read as zeros
+            err = 0;
+            for (size_t done = 0; done < len && err == 0; done += BLOCK_SIZE)
+                err = write_all(fd, zero, len - done < BLOCK_SIZE ? len - done : BLOCK_SIZE);
+        } else {
+            if (!block_is_valid(block) || !block_is_valid(block + run_len - 1)) return EIO;
+            err = write_all(fd, block_ptr(block), len);
+        }
+        if (err != 0) return err;
+        remaining -= len;
+    }
+    return remaining == 0 ? 0 : EIO;
+}
+
+/*
+ * Returns the permission bits to create a local copy of inode with
+ */
+static mode_t export_mode(struct ext2_inode *inode) {
+    mode_t mode = inode->i_mode & 07777;
+    if (mode == 0) mode = (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR ? 0755 : 0644; // Tools here create inodes without permission bits
+    return mode;
+}
+
+/*
+ * Recreates the symlink inode at local_path
+ * Returns 0 on success or an errno value
+ */
+static int export_symlink(struct ext2_inode *inode, char *local_path) {
+    if (inode->i_size >= BLOCK_SIZE) return EIO;
+    char target[EXT2_MAX_BLOCK_SIZE];
+    if (inode->i_blocks == 0) {
+        if (inode->i_size > sizeof(inode->i_block)) return EIO;
+        memcpy(target, inode->i_block, inode->i_size);
+    } else {
+        if (!block_is_valid(inode->i_block[0])) return EIO;
+        memcpy(target, block_ptr(inode->i_block[0]), inode->i_size);
+    }
+    target[inode->i_size] = '\0';
+    if (symlink(target, local_path) == -1) return errno;
+    return 0;
+}
+
+// Pool task writing the export_job arg to its local file
+static void export_file(void *arg) {
+    struct export_job *job = arg;
+    int fd = open(job->local_path, O_WRONLY | O_CREAT | O_TRUNC, export_mode(job->inode));
+    if (fd == -1) {
+        job->err = errno;
+        return;
+    }
+    job->err = export_inode(job->inode, fd);
+    if (close(fd) == -1 && job->err == 0) job->err = errno;
+}
+
+// Returns dir/name (name_len bytes) in a new string
+static char *export_join(const char *dir, const char *name, int name_len) {
+    char *path = malloc(strlen(dir) + name_len + 2);
+    if (path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(path, "%s/%.*s", dir, name_len, name);
+    return path;
+}
+
+/*
+ * Exports the entries of directory inode dir into the existing local directory local_dir
+ * Files are handed to pool, or written inline if pool is NULL, and each file's job is pushed onto *jobs.
+ * Errors are reported and skipped
+ * Returns 0 if everything was exported or the errno value of the first failure
+ */
+static int export_dir(struct ext2_inode *dir, char *local_dir, struct task_pool *pool, struct export_job **jobs) {
+    int first_err = 0;
+    struct block_iter it;
+    unsigned int block;
+    block_iter_init(&it, dir);
+    while (block_iter_next(&it, &block)) {
+        if (!block_is_valid(block)) continue;
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block_ptr(block);
+        int sum = 0;
+        for (; sum < BLOCK_SIZE && entry->rec_len != 0; sum += entry->rec_len,
+                entry = (struct ext2_dir_entry *)(((char *)entry) + entry->rec_len)) {
+            if (entry->inode == 0 || !inode_is_valid(entry->inode)) continue;
+            if ((entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) continue;
+            struct ext2_inode *inode = inode_by_index(entry->inode);
+            char *local_path = export_join(local_dir, entry->name, entry->name_len);
+            int err = 0;
+            switch (inode->i_mode & EXT2_S_IFMT) {
+                case EXT2_S_IFDIR:
+                    if (mkdir(local_path, export_mode(inode)) == -1 && errno != EEXIST) err = errno;
+                    else err = export_dir(inode, local_path, pool, jobs);
+                    free(local_path);
+                    break;
+                case EXT2_S_IFREG: {
+                    struct export_job *job = malloc(sizeof(struct export_job));
+                    if (job == NULL) {
+                        perror("malloc");
+                        exit(1);
+                    }
+                    job->local_path = local_path; // The job keeps local_path until it is written
+                    job->inode = inode;
+                    job->err = 0;
+                    job->next = *jobs;
+                    *jobs = job;
+                    if (pool != NULL) pool_submit(pool, export_file, job);
+                    else export_file(job);
+                    break;
+                }
+                case EXT2_S_IFLNK:
+                    err = export_symlink(inode, local_path);
+                    if (err != 0) fprintf(stderr, "%s: %s\n", local_path, strerror(err));
+                    free(local_path);
+                    break;
+                default:
+                    free(local_path);
+                    break;
+            }
+            if (first_err == 0) first_err = err;
+        }
+    }
+    return first_err;
+}
+
+/*
+ * Exports image_path to local_path, or to stdout if local_path is NULL
+ * If local_path is an existing directory the copy keeps its name on the image. Directories are only exported
+ * with recursive != 0, writing their files on pool, or inline if pool is NULL
+ * Returns 0 if everything was exported or the errno value of the first failure
+ */
+int ext2_export(char *image_path, char *local_path, int recursive, struct task_pool *pool) {
+    struct ext2_dir_entry *entry = get_dir_entry_by_path(image_path, 0);
+    if (entry == NULL) return ENOENT;
+    struct ext2_inode *inode = inode_by_index(entry->inode);
+    if (inode == NULL) return ENOENT;
+    int type = inode->i_mode & EXT2_S_IFMT;
+    if (type == EXT2_S_IFDIR && (!recursive || local_path == NULL)) return EISDIR;
+    if (local_path == NULL) return export_inode(inode, STDOUT_FILENO);
+
+    char *dest;
+    struct stat st;
+    if (stat(local_path, &st) == 0 && S_ISDIR(st.st_mode)) { // Export into the directory under the image name
+        dest = strcmp(image_path, "/") == 0 ? strdup(local_path) : export_join(local_path, entry->name, entry->name_len);
+    } else {
+        dest = strdup(local_path);
+    }
+    int err = 0;
+    if (type == EXT2_S_IFLNK) {
+        err = export_symlink(inode, dest);
+    } else if (type == EXT2_S_IFDIR) {
+        struct export_job *jobs = NULL;
+        if (mkdir(dest, export_mode(inode)) == -1 && errno != EEXIST) err = errno;
+        else err = export_dir(inode, dest, pool, &jobs);
+        if (pool != NULL) pool_wait(pool);
+        while (jobs != NULL) {
+            struct export_job *job = jobs;
+            jobs = job->next;
+            if (job->err != 0) {
+                fprintf(stderr, "%s: %s\n", job->local_path, strerror(job->err));
+                if (err == 0) err = job->err;
+            }
+            free(job->local_path);
+            free(job);
+        }
+    } else {
+        struct export_job job = { dest, inode, 0, NULL };
+        export_file(&job);
+        err = job.err;
+    }
+    free(dest);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    int recursive = 0;
+    int threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        if (opt == 'r') {
+            recursive = 1;
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            threads = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-r] [-j threads] <image file name> <absolute path on virtual disk> [path on local system]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 2 && optind != argc - 3) {
+        fprintf(stderr, "Usage: %s [-r] [-j threads] <image file name> <absolute path on virtual disk> [path on local system]\n", argv[0]);
+        exit(1);
+    }
+    open_image_read_only(argv[optind]);
+    struct task_pool *pool = NULL;
+    if (recursive && threads > 1) {
+        pool = pool_create(threads);
+        if (pool == NULL) {
+            fprintf(stderr, "Couldn't start %d threads\n", threads);
+            exit(1);
+        }
+    }
+    int err = ext2_export(argv[optind + 1], optind == argc - 3 ? argv[optind + 2] : NULL, recursive, pool);
+    if (pool != NULL) pool_destroy(pool);
+    close_image();
+    return err;
+}
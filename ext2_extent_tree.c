@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Free-extent tree
+ * Holds disjoint runs [start, start + len) in a treap ordered by start, where every node also records the
+ * longest run in its subtree. That lets a search skip any subtree that can't hold the length it wants, so
+ * finding the first run of at least n from a position, or the longest run, takes O(log n) expected steps.
+ * Adjacent runs are merged as they are inserted. Nodes live in one array and refer to each other by index
+ */
+
+#define EXTENT_NIL -1
+
+struct extent_node {
+    int start;
+    int len;
+    int max_len;      // Longest len in this node's subtree
+    unsigned int priority;
+    int left;
+    int right;        // Also links unused nodes into the free list
+};
+
+struct extent_tree {
+    struct extent_node *nodes;
+    int cap;
+    int root;
+    int free_list;    // First unused node
+    unsigned int seed;
+};
+
+void extent_tree_init(struct extent_tree *tree) {
+    tree->nodes = NULL;
+    tree->cap = 0;
+    tree->root = EXTENT_NIL;
+    tree->free_list = EXTENT_NIL;
+    tree->seed = 2463534242u;
+}
+
+// Returns the longest run in the subtree rooted at n
+static inline int extent_max(struct extent_tree *tree, int n) {
+    return n == EXTENT_NIL ? 0 : tree->nodes[n].max_len;
+}
+
+// Recomputes max_len of n from its children
+static inline void extent_update(struct extent_tree *tree, int n) {
+    struct extent_node *node = &tree->nodes[n];
+    int m = node->len;
+    if (extent_max(tree, node->left) > m) m = extent_max(tree, node->left);
+    if (extent_max(tree, node->right) > m) m = extent_max(tree, node->right);
+    node->max_len = m;
+}
+
+// Returns a new node for the run [start, start + len)
+static int extent_new_node(struct extent_tree *tree, int start, int len) {
+    if (tree->free_list == EXTENT_NIL) {
+        int cap = tree->cap ? 2 * tree->cap : 64;
+        struct extent_node *nodes = realloc(tree->nodes, cap * sizeof(struct extent_node));
+        if (nodes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        for (int i = cap - 1; i >= tree->cap; i--) {
+            nodes[i].right = tree->free_list;
+            tree->free_list = i;
+        }
+        tree->nodes = nodes;
+        tree->cap = cap;
+    }
+    int n = tree->free_list;
+    tree->free_list = tree->nodes[n].right;
+    // xorshift32 priorities keep the treap balanced in expectation
+    tree->seed ^= tree->seed << 13;
+    tree->seed ^= tree->seed >> 17;
+    tree->seed ^= tree->seed << 5;
+    tree->nodes[n] = (struct extent_node){ start, len, len, tree->seed, EXTENT_NIL, EXTENT_NIL };
+    return n;
+}
+
+static void extent_free_node(struct extent_tree *tree, int n) {
+    tree->nodes[n].right = tree->free_list;
+    tree->free_list = n;
+}
+
+// Splits the subtree rooted at n into runs starting before key (*l) and at or after key (*r)
+static void extent_split(struct extent_tree *tree, int n, int key, int *l, int *r) {
+    if (n == EXTENT_NIL) {
+        *l = *r = EXTENT_NIL;
+    } else if (tree->nodes[n].start < key) {
+        extent_split(tree, tree->nodes[n].right, key, &tree->nodes[n].right, r);
+        extent_update(tree, n);
+        *l = n;
+    } else {
+        extent_split(tree, tree->nodes[n].left, key, l, &tree->nodes[n].left);
+        extent_update(tree, n);
+        *r = n;
+    }
+}
+
+// Joins subtrees l and r, where every run in l starts before every run in r
+static int extent_merge(struct extent_tree *tree, int l, int r) {
+    if (l == EXTENT_NIL) return r;
+    if (r == EXTENT_NIL) return l;
+    if (tree->nodes[l].priority > tree->nodes[r].priority) {
+        tree->nodes[l].right = extent_merge(tree, tree->nodes[l].right, r);
+        extent_update(tree, l);
+        return l;
+    }
+    tree->nodes[r].left = extent_merge(tree, l, tree->nodes[r].left);
+    extent_update(tree, r);
+    return r;
+}
+
+// Detaches the last run of the subtree rooted at *n and returns its node, or EXTENT_NIL if it is empty
+static int extent_pop_last(struct extent_tree *tree, int *n) {
+    if (*n == EXTENT_NIL) return EXTENT_NIL;
+    if (tree->nodes[*n].right == EXTENT_NIL) {
+        int last = *n;
+        *n = tree->nodes[last].left;
+        tree->nodes[last].left = EXTENT_NIL;
+        extent_update(tree, last);
+        return last;
+    }
+    int last = extent_pop_last(tree, &tree->nodes[*n].right);
+    extent_update(tree, *n);
+    return last;
+}
+
+// Detaches the first run of the subtree rooted at *n and returns its node, or EXTENT_NIL if it is empty
+static int extent_pop_first(struct extent_tree *tree, int *n) {
+    if (*n == EXTENT_NIL) return EXTENT_NIL;
+    if (tree->nodes[*n].left == EXTENT_NIL) {
+        int first = *n;
+        *n = tree->nodes[first].right;
+        tree->nodes[first].right = EXTENT_NIL;
+        extent_update(tree, first);
+        return first;
+    }
+    int first = extent_pop_first(tree, &tree->nodes[*n].left);
+    extent_update(tree, *n);
+    return first;
+}
+
+/*
+ * Adds the run [start, start + len), which must not overlap the tree's runs, merging it with adjacent runs
+ */
+void extent_tree_insert(struct extent_tree *tree, int start, int len) {
+    int l, r;
+    extent_split(tree, tree->root, start, &l, &r);
+    int prev = extent_pop_last(tree, &l);
+    if (prev != EXTENT_NIL) {
+        if (tree->nodes[prev].start + tree->nodes[prev].len == start) {
+            start = tree->nodes[prev].start;
+            len += tree->nodes[prev].len;
+            extent_free_node(tree, prev);
+        } else {
+            l = extent_merge(tree, l, prev);
+        }
+    }
+    int next = extent_pop_first(tree, &r);
+    if (next != EXTENT_NIL) {
+        if (tree->nodes[next].start == start + len) {
+            len += tree->nodes[next].len;
+            extent_free_node(tree, next);
+        } else {
+            r = extent_merge(tree, next, r);
+        }
+    }
+    tree->root = extent_merge(tree, extent_merge(tree, l, extent_new_node(tree, start, len)), r);
+}
+
+/*
+ * Removes [start, start + len) from the run that holds it, keeping the parts of the run on either side
+ * Returns 0 on success or -1 if no single run holds the whole range
+ */
+int extent_tree_remove(struct extent_tree *tree, int start, int len) {
+    int l, r;
+    extent_split(tree, tree->root, start + 1, &l, &r);
+    int n = extent_pop_last(tree, &l);
+    if (n == EXTENT_NIL || tree->nodes[n].start + tree->nodes[n].len < start + len) {
+        if (n != EXTENT_NIL) l = extent_merge(tree, l, n);
+        tree->root = extent_merge(tree, l, r);
+        return -1;
+    }
+    int run_start = tree->nodes[n].start;
+    int run_end = run_start + tree->nodes[n].len;
+    extent_free_node(tree, n);
+    if (run_start < start) l = extent_merge(tree, l, extent_new_node(tree, run_start, start - run_start));
+    if (start + len < run_end) l = extent_merge(tree, l, extent_new_node(tree, start + len, run_end - start - len));
+    tree->root = extent_merge(tree, l, r);
+    return 0;
+}
+
+// Returns the first node in the subtree rooted at n starting at or after from with len >= need, or EXTENT_NIL
+static int extent_find_from(struct extent_tree *tree, int n, int from, int need) {
+    while (n != EXTENT_NIL && extent_max(tree, n) >= need) {
+        struct extent_node *node = &tree->nodes[n];
+        if (node->start < from) {
+            n = node->right;
+            continue;
+        }
+        int found = extent_find_from(tree, node->left, from, need);
+        if (found != EXTENT_NIL) return found;
+        if (node->len >= need) return n;
+        n = node->right;
+    }
+    return EXTENT_NIL;
+}
+
+/*
+ * Finds the first free stretch of at least need positions at or after from: the rest of the run holding from
+ * if it is long enough, otherwise the first long enough run starting after from
+ * Sets *start and *len to the stretch and returns 1, or returns 0 if there is none
+ */
+int extent_tree_next_fit(struct extent_tree *tree, int from, int need, int *start, int *len) {
+    // Last run starting at or before from
+    int holder = EXTENT_NIL;
+    for (int n = tree->root; n != EXTENT_NIL; ) {
+        if (tree->nodes[n].start <= from) {
+            holder = n;
+            n = tree->nodes[n].right;
+        } else {
+            n = tree->nodes[n].left;
+        }
+    }
+    if (holder != EXTENT_NIL) {
+        int end = tree->nodes[holder].start + tree->nodes[holder].len;
+        if (end - from >= need) {
+            *start = from;
+            *len = end - from;
+            return 1;
+        }
+    }
+    int n = extent_find_from(tree, tree->root, from, need);
+    if (n == EXTENT_NIL) return 0;
+    *start = tree->nodes[n].start;
+    *len = tree->nodes[n].len;
+    return 1;
+}
+
+/*
+ * Sets *start and *len to the first of the longest runs and returns 1, or returns 0 if the tree is empty
+ */
+int extent_tree_longest(struct extent_tree *tree, int *start, int *len) {
+    if (tree->root == EXTENT_NIL) return 0;
+    int n = extent_find_from(tree, tree->root, 0, extent_max(tree, tree->root));
+    *start = tree->nodes[n].start;
+    *len = tree->nodes[n].len;
+    return 1;
+}
+
+// Returns the length of the longest run, 0 if the tree is empty
+int extent_tree_max(struct extent_tree *tree) {
+    return extent_max(tree, tree->root);
+}
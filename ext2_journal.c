@@ -0,0 +1,770 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+/*
+ * Metadata journal
+ * An image with an ext3 journal inode (added by ext2_mkjournal or tune2fs -j) is updated through the journal.
+ * open_image then maps the image privately, so the tools' changes stay in memory until journal_commit() finds
+ * the blocks they changed (from the pages the process has copied, see /proc/self/pagemap) and writes them:
+ *  - Blocks allocated in the transaction that were free when it started aren't reachable from the image yet,
+ *    so they are written straight to their place and flushed before the transaction is logged, like ext3's
+ *    ordered data, so a committed transaction never points at blocks that didn't reach the disk
+ *  - Every other changed block is logged as one JBD2 transaction: descriptor blocks, the block copies and
+ *    a commit block holding the CRC32 of the transaction (async_commit). A torn transaction fails its checksum,
+ *    so one fsync makes the whole transaction durable, after which its blocks are written to their place
+ * File data doesn't go through the private mapping, where every block copied would take memory until the commit:
+ * blocks marked with journal_block_data() are written straight to the image file by journal_write_data() and
+ * only flushed with the other new blocks before the transaction is logged.
+ * A transaction must fit in the log. journal_end_op() asks for a commit whenever the next operation could make
+ * the running transaction too big, going by how much the pages of the mapping written so far and the biggest
+ * operation yet would take; a single operation that still doesn't fit is discarded and the tool fails, leaving
+ * the image as the last commit left it. Transactions are appended to the log until it is full or the image is
+ * closed, when the log is emptied.
+ * open_image replays the committed transactions left in the log by a crash, as e2fsck and the kernel would
+ */
+
+#define JBD2_MAGIC 0xC03B3998U
+#define JBD2_DESCRIPTOR_BLOCK 1
+#define JBD2_COMMIT_BLOCK 2
+#define JBD2_SUPERBLOCK_V1 3
+#define JBD2_SUPERBLOCK_V2 4
+#define JBD2_REVOKE_BLOCK 5
+
+#define JBD2_FEATURE_COMPAT_CHECKSUM 0x1
+#define JBD2_FEATURE_INCOMPAT_REVOKE 0x1
+#define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT 0x4
+
+#define JBD2_FLAG_ESCAPE 1    // The block started with JBD2_MAGIC, which was zeroed in the log
+#define JBD2_FLAG_SAME_UUID 2 // No UUID follows the tag
+#define JBD2_FLAG_LAST_TAG 8
+
+#define JBD2_CRC32_CHKSUM 1
+#define JBD2_CRC32_CHKSUM_SIZE 4
+
+// Most blocks one tool operation is expected to change, used to decide when a batch should be committed
+#define JOURNAL_OP_BLOCKS 16
+
+/*
+ * On-disk structures of the journal. Every field is big-endian
+ */
+struct journal_header {
+    unsigned int h_magic;
+    unsigned int h_blocktype;
+    unsigned int h_sequence;  // Transaction the block belongs to
+};
+
+struct journal_superblock {
+    struct journal_header s_header;
+    unsigned int  s_blocksize;
+    unsigned int  s_maxlen;          // Journal length in blocks
+    unsigned int  s_first;           // First log block
+    unsigned int  s_sequence;        // First transaction expected in the log
+    unsigned int  s_start;           // Log block of that transaction, 0 if the log is empty
+    unsigned int  s_errno;
+    /* Only for JBD2_SUPERBLOCK_V2 */
+    unsigned int  s_feature_compat;
+    unsigned int  s_feature_incompat;
+    unsigned int  s_feature_ro_compat;
+    unsigned char s_uuid[16];
+    unsigned int  s_nr_users;
+    /* The rest of the block isn't used here */
+};
+
+// Tag of a descriptor block naming the image block of one of the blocks after it
+struct journal_tag {
+    unsigned int   t_blocknr;
+    unsigned short t_checksum;
+    unsigned short t_flags;
+};
+
+struct journal_commit_header {
+    struct journal_header h_header;
+    unsigned char      h_chksum_type;
+    unsigned char      h_chksum_size;
+    unsigned char      h_padding[2];
+    unsigned int       h_chksum[8];
+    unsigned long long h_commit_sec;
+    unsigned int       h_commit_nsec;
+};
+
+struct journal_revoke_header {
+    struct journal_header r_header;
+    unsigned int r_count;  // Bytes of the block in use, header included
+};
+
+// Tags a descriptor block holds when only its first tag is followed by a UUID
+#define JOURNAL_TAGS_PER_BLOCK ((BLOCK_SIZE - (int)sizeof(struct journal_header) - 16) / (int)sizeof(struct journal_tag))
+
+// State of the journal of the open image
+struct journal {
+    int active;                  // Nonzero when changes go through the journal
+    unsigned int *blocks;        // Image block holding each journal block
+    unsigned int maxlen;         // Journal length in blocks
+    unsigned int first;          // First log block, after the journal superblock
+    unsigned int head;           // Log block the next transaction is written at
+    unsigned int tail;           // Log block of the oldest transaction that may still need replaying, 0 if none
+    unsigned int sequence;       // ID of the next transaction
+    int logged;                  // Nonzero once a transaction has been logged since the image was opened
+    int max_blocks;              // Most changed blocks one transaction can log
+    int ops;                     // Operations ended in the running transaction
+    int max_ops;                 // Operations to commit after when the mapping's written pages can't be counted
+    long op_start;               // Blocks the running transaction had changed when the last operation ended
+    long op_blocks;              // Most blocks one operation has changed
+    unsigned char *super;        // The journal superblock
+    unsigned char *new_blocks;   // Blocks allocated in the running transaction that were free when it started
+    unsigned char *freed_blocks; // Blocks freed in the running transaction
+    unsigned char *data_blocks;  // New blocks of file data, written straight to the image file
+    long data_count;             // Blocks set in data_blocks
+    int pagemap_fd;              // /proc/self/pagemap, or -1 to compare every page with the image
+};
+
+struct journal journal;
+
+// Revoke record: blocks logged before transaction sequence mustn't be replayed
+struct journal_revoke {
+    unsigned int block;
+    unsigned int sequence;
+};
+
+struct journal_revoke *revokes;
+int revoke_count;
+int revoke_cap;
+
+enum journal_pass { JOURNAL_SCAN, JOURNAL_REVOKE, JOURNAL_REPLAY };
+
+/*
+ * Returns crc updated with the len bytes at p, using the big-endian CRC32 jbd2 checksums transactions with
+ */
+static unsigned int journal_crc32(unsigned int crc, const unsigned char *p, size_t len) {
+    static unsigned int table[256];
+    if (table[1] == 0) {
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int c = i << 24;
+            for (int bit = 0; bit < 8; bit++) c = (c & 0x80000000U) ? (c << 1) ^ 0x04C11DB7U : c << 1;
+            table[i] = c;
+        }
+    }
+    while (len-- > 0) crc = (crc << 8) ^ table[(crc >> 24) ^ *p++];
+    return crc;
+}
+
+// Reads block of the image file into buf. Exits with an error message on failure
+static void image_read_block(unsigned int block, unsigned char *buf) {
+    if (pread(image_fd, buf, BLOCK_SIZE, (off_t)BLOCK_SIZE * block) != BLOCK_SIZE) {
+        perror("pread");
+        exit(1);
+    }
+}
+
+// Writes buf to block of the image file. Exits with an error message on failure
+static void image_write_block(unsigned int block, const unsigned char *buf) {
+    if (pwrite(image_fd, buf, BLOCK_SIZE, (off_t)BLOCK_SIZE * block) != BLOCK_SIZE) {
+        perror("pwrite");
+        exit(1);
+    }
+}
+
+// Writes len bytes of buf to the image file at offset. Returns 0 on success or -1 on failure
+static int image_write(const unsigned char *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(image_fd, buf + done, len - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Writes the count blocks in blocks, in ascending order, from the mapping to their place in the image file, one
+// write per run of consecutive blocks. Exits with an error message on failure
+static void image_write_blocks(const unsigned int *blocks, int count) {
+    for (int i = 0; i < count; ) {
+        int n = 1;
+        while (i + n < count && blocks[i + n] == blocks[i] + n) n++;
+        if (image_write(block_ptr(blocks[i]), (size_t)n * BLOCK_SIZE, (off_t)BLOCK_SIZE * blocks[i]) == -1) {
+            perror("pwrite");
+            exit(1);
+        }
+        i += n;
+    }
+}
+
+// Makes every write to the image file durable. Exits with an error message on failure
+static void image_sync() {
+    if (fsync(image_fd) == -1) {
+        perror("fsync");
+        exit(1);
+    }
+}
+
+// Returns the log block after pos, wrapping around to the first
+static unsigned int journal_next(unsigned int pos) {
+    return pos + 1 == journal.maxlen ? journal.first : pos + 1;
+}
+
+static struct journal_superblock *journal_super() {
+    return (struct journal_superblock *)journal.super;
+}
+
+// Writes the journal superblock back to the journal
+static void journal_write_super() {
+    image_write_block(journal.blocks[0], journal.super);
+}
+
+/*
+ * Sets or clears the needs_recovery flag, which tells e2fsck and the kernel that the log holds transactions,
+ * both in the mapped superblock and in the image file
+ */
+static void journal_mark_recover(int needs_recovery) {
+    if (needs_recovery) sb->s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+    else sb->s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+    off_t offset = EXT2_SUPER_OFFSET + offsetof(struct ext2_super_block, s_feature_incompat);
+    if (pwrite(image_fd, &sb->s_feature_incompat, sizeof(unsigned int), offset) != sizeof(unsigned int)) {
+        perror("pwrite");
+        exit(1);
+    }
+}
+
+// Fills in the header of a journal block
+static void journal_header_init(unsigned char *buf, unsigned int type, unsigned int sequence) {
+    struct journal_header *header = (struct journal_header *)buf;
+    header->h_magic = htonl(JBD2_MAGIC);
+    header->h_blocktype = htonl(type);
+    header->h_sequence = htonl(sequence);
+}
+
+/*
+ * Fills buf with the superblock of a new, empty journal of maxlen blocks for the open image
+ */
+void journal_format_super(unsigned char *buf, unsigned int maxlen) {
+    memset(buf, 0, BLOCK_SIZE);
+    struct journal_superblock *jsb = (struct journal_superblock *)buf;
+    journal_header_init(buf, JBD2_SUPERBLOCK_V2, 0);
+    jsb->s_blocksize = htonl(BLOCK_SIZE);
+    jsb->s_maxlen = htonl(maxlen);
+    jsb->s_first = htonl(1);
+    jsb->s_sequence = htonl(1);
+    jsb->s_feature_compat = htonl(JBD2_FEATURE_COMPAT_CHECKSUM);
+    jsb->s_feature_incompat = htonl(JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT);
+    memcpy(jsb->s_uuid, sb->s_uuid, sizeof(jsb->s_uuid));
+    jsb->s_nr_users = htonl(1);
+}
+
+// Records that block is revoked by transaction sequence
+static void journal_revoke(unsigned int block, unsigned int sequence) {
+    for (int i = 0; i < revoke_count; i++) {
+        if (revokes[i].block == block) {
+            if (sequence > revokes[i].sequence) revokes[i].sequence = sequence;
+            return;
+        }
+    }
+    if (revoke_count == revoke_cap) {
+        revoke_cap = revoke_cap ? 2 * revoke_cap : 64;
+        revokes = realloc(revokes, revoke_cap * sizeof(struct journal_revoke));
+        if (revokes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    revokes[revoke_count++] = (struct journal_revoke){ block, sequence };
+}
+
+// Returns 0 iff the copy of block logged by transaction sequence may be replayed
+static int journal_revoked(unsigned int block, unsigned int sequence) {
+    for (int i = 0; i < revoke_count; i++)
+        if (revokes[i].block == block) return revokes[i].sequence >= sequence;
+    return 0;
+}
+
+/*
+ * Walks the transactions in the log from the journal superblock's start
+ * JOURNAL_SCAN finds where the committed ones end: it returns the ID after the last transaction whose commit
+ * block is in the log and, if the journal has checksums, matches it. JOURNAL_REVOKE collects the revoke records
+ * of the transactions before end, and JOURNAL_REPLAY writes their blocks to their place in the image
+ * Returns the ID of the transaction the walk stopped at
+ */
+static unsigned int journal_pass(enum journal_pass pass, unsigned int end) {
+    struct journal_superblock *jsb = journal_super();
+    int checksums = ntohl(jsb->s_header.h_blocktype) == JBD2_SUPERBLOCK_V2 &&
+                    (ntohl(jsb->s_feature_compat) & JBD2_FEATURE_COMPAT_CHECKSUM);
+    unsigned int sequence = ntohl(jsb->s_sequence);
+    unsigned int pos = ntohl(jsb->s_start);
+    unsigned int crc = ~0U;
+    unsigned char *buf = malloc(BLOCK_SIZE);
+    unsigned char *data = malloc(BLOCK_SIZE);
+    if (buf == NULL || data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    // A log that never stops matching can't be longer than the journal
+    for (unsigned int steps = 0; (pass == JOURNAL_SCAN || sequence != end) && steps < journal.maxlen; steps++) {
+        image_read_block(journal.blocks[pos], buf);
+        struct journal_header *header = (struct journal_header *)buf;
+        if (ntohl(header->h_magic) != JBD2_MAGIC || ntohl(header->h_sequence) != sequence) break;
+        unsigned int type = ntohl(header->h_blocktype);
+        pos = journal_next(pos);
+        if (type == JBD2_DESCRIPTOR_BLOCK) {
+            if (pass == JOURNAL_SCAN) crc = journal_crc32(crc, buf, BLOCK_SIZE);
+            // Each tag names the image block of the next block in the log
+            for (int offset = sizeof(struct journal_header); offset + sizeof(struct journal_tag) <= BLOCK_SIZE; ) {
+                struct journal_tag *tag = (struct journal_tag *)(buf + offset);
+                unsigned int flags = ntohs(tag->t_flags);
+                offset += sizeof(struct journal_tag) + (flags & JBD2_FLAG_SAME_UUID ? 0 : 16);
+                if (pass == JOURNAL_SCAN) {
+                    image_read_block(journal.blocks[pos], data);
+                    crc = journal_crc32(crc, data, BLOCK_SIZE);
+                } else if (pass == JOURNAL_REPLAY) {
+                    unsigned int block = ntohl(tag->t_blocknr);
+                    if (block < sb->s_blocks_count && !journal_revoked(block, sequence)) {
+                        image_read_block(journal.blocks[pos], data);
+                        if (flags & JBD2_FLAG_ESCAPE) *(unsigned int *)data = htonl(JBD2_MAGIC);
+                        image_write_block(block, data);
+                    }
+                }
+                pos = journal_next(pos);
+                if (flags & JBD2_FLAG_LAST_TAG) break;
+            }
+        } else if (type == JBD2_COMMIT_BLOCK) {
+            struct journal_commit_header *commit = (struct journal_commit_header *)buf;
+            if (pass == JOURNAL_SCAN && checksums && commit->h_chksum_type != 0 &&
+                (commit->h_chksum_type != JBD2_CRC32_CHKSUM || commit->h_chksum_size != JBD2_CRC32_CHKSUM_SIZE ||
+                 ntohl(commit->h_chksum[0]) != crc)) break; // Torn transaction, the log ends before it
+            crc = ~0U;
+            sequence++;
+        } else if (type == JBD2_REVOKE_BLOCK) {
+            if (pass == JOURNAL_REVOKE) {
+                struct journal_revoke_header *revoke = (struct journal_revoke_header *)buf;
+                unsigned int used = ntohl(revoke->r_count);
+                for (unsigned int offset = sizeof(struct journal_revoke_header);
+                     offset + sizeof(unsigned int) <= used && offset + sizeof(unsigned int) <= BLOCK_SIZE;
+                     offset += sizeof(unsigned int))
+                    journal_revoke(ntohl(*(unsigned int *)(buf + offset)), sequence);
+            }
+        } else {
+            break;
+        }
+    }
+    free(buf);
+    free(data);
+    return sequence;
+}
+
+/*
+ * Replays the committed transactions in the log into the image and empties the log
+ */
+static void journal_recover(char *path) {
+    struct journal_superblock *jsb = journal_super();
+    unsigned int start = ntohl(jsb->s_sequence);
+    unsigned int end = journal_pass(JOURNAL_SCAN, 0);
+    journal_pass(JOURNAL_REVOKE, end);
+    journal_pass(JOURNAL_REPLAY, end);
+    image_sync();
+    jsb->s_start = 0;
+    jsb->s_sequence = htonl(end);
+    journal_write_super();
+    journal_mark_recover(0);
+    image_sync();
+    free(revokes);
+    revokes = NULL;
+    revoke_count = revoke_cap = 0;
+    if (end != start) fprintf(stderr, "%s: replayed %u journal transactions\n", path, end - start);
+}
+
+/*
+ * Loads the journal of the open image if it has one, replays the transactions a crash left in it and maps the
+ * image privately, so changes only reach the image through journal_commit()
+ * Exits with an error message if the image has a journal this can't use
+ */
+void journal_open(char *path) {
+    journal.active = 0;
+    if (!(sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL)) return;
+    if (sb->s_journal_inum == 0) {
+        fprintf(stderr, "%s: external journals aren't supported\n", path);
+        exit(1);
+    }
+    struct ext2_inode *inode = inode_by_index(sb->s_journal_inum);
+    unsigned int count = inode == NULL ? 0 : inode->i_size / BLOCK_SIZE;
+    journal.blocks = malloc((count + 1) * sizeof(unsigned int));
+    journal.super = malloc(BLOCK_SIZE);
+    if (journal.blocks == NULL || journal.super == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        journal.blocks[i] = inode_bmap(inode, i);
+        if (!block_is_valid(journal.blocks[i])) count = 0;
+    }
+    if (count < 2) {
+        fprintf(stderr, "%s: journal inode is damaged\n", path);
+        exit(1);
+    }
+    image_read_block(journal.blocks[0], journal.super);
+    struct journal_superblock *jsb = journal_super();
+    unsigned int type = ntohl(jsb->s_header.h_blocktype);
+    journal.maxlen = ntohl(jsb->s_maxlen);
+    journal.first = ntohl(jsb->s_first);
+    if (ntohl(jsb->s_header.h_magic) != JBD2_MAGIC || (type != JBD2_SUPERBLOCK_V1 && type != JBD2_SUPERBLOCK_V2) ||
+        ntohl(jsb->s_blocksize) != BLOCK_SIZE || journal.maxlen > count || journal.first < 1 ||
+        journal.first + JOURNAL_TAGS_PER_BLOCK >= journal.maxlen) {
+        fprintf(stderr, "%s: bad journal superblock\n", path);
+        exit(1);
+    }
+    if (type == JBD2_SUPERBLOCK_V2 && ((ntohl(jsb->s_feature_compat) & ~JBD2_FEATURE_COMPAT_CHECKSUM) ||
+        (ntohl(jsb->s_feature_incompat) & ~(JBD2_FEATURE_INCOMPAT_REVOKE | JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)) ||
+        ntohl(jsb->s_feature_ro_compat))) {
+        fprintf(stderr, "%s: journal has features that aren't supported\n", path);
+        exit(1);
+    }
+
+    if (jsb->s_start != 0) journal_recover(path);
+    else if (sb->s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER) journal_mark_recover(0);
+
+    // Transactions are committed with checksums and a single flush
+    if (type == JBD2_SUPERBLOCK_V1) memset(&jsb->s_feature_compat, 0, BLOCK_SIZE - offsetof(struct journal_superblock, s_feature_compat));
+    jsb->s_header.h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+    jsb->s_feature_compat |= htonl(JBD2_FEATURE_COMPAT_CHECKSUM);
+    jsb->s_feature_incompat |= htonl(JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT);
+    journal.sequence = ntohl(jsb->s_sequence);
+    journal.head = journal.first;
+    journal.tail = 0;
+    journal.logged = 0;
+    unsigned int size = journal.maxlen - journal.first;
+    journal.max_blocks = (size - 3) * JOURNAL_TAGS_PER_BLOCK / (JOURNAL_TAGS_PER_BLOCK + 1);
+    journal.ops = 0;
+    journal.max_ops = journal.max_blocks / JOURNAL_OP_BLOCKS > 0 ? journal.max_blocks / JOURNAL_OP_BLOCKS : 1;
+    journal.op_start = 0;
+    journal.op_blocks = JOURNAL_OP_BLOCKS;
+    journal.new_blocks = calloc((sb->s_blocks_count + 7) / 8, 1);
+    journal.freed_blocks = calloc((sb->s_blocks_count + 7) / 8, 1);
+    journal.data_blocks = calloc((sb->s_blocks_count + 7) / 8, 1);
+    journal.data_count = 0;
+    if (journal.new_blocks == NULL || journal.freed_blocks == NULL || journal.data_blocks == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    journal.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+
+    // Only the pages written take memory, so an image bigger than memory and swap can still be mapped privately
+    int flags = MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE;
+    if (mmap(disk, image_size, PROT_READ | PROT_WRITE, flags, image_fd, 0) == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // Every transaction's copy of the superblock carries the flag, and journal_close() clears it
+    sb->s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+    journal.active = 1;
+}
+
+// Notes that blocks [block, block + len) were allocated in the running transaction
+void journal_block_allocated(int block, int len) {
+    if (!journal.active) return;
+    for (int b = block; b < block + len; b++) {
+        // A block freed earlier in the transaction may still be in use in the image
+        if (!bitmap_test(journal.freed_blocks, b)) bitmap_set(journal.new_blocks, b);
+    }
+}
+
+// Notes that blocks [block, block + len) were freed in the running transaction
+void journal_block_freed(int block, int len) {
+    if (!journal.active) return;
+    bitmap_set_range(journal.freed_blocks, block, len);
+    bitmap_clear_range(journal.new_blocks, block, len);
+    for (int b = block; b < block + len; b++) {
+        if (bitmap_test(journal.data_blocks, b)) journal.data_count--;
+    }
+    bitmap_clear_range(journal.data_blocks, block, len);
+}
+
+/*
+ * Notes that blocks [block, block + len), just allocated, will hold file data, which the caller writes with
+ * journal_write_data() instead of through the mapping. Must be called from the thread that allocates
+ */
+void journal_block_data(int block, int len) {
+    if (!journal.active) return;
+    for (int b = block; b < block + len; b++) {
+        if (!bitmap_test(journal.data_blocks, b)) journal.data_count++;
+    }
+    bitmap_set_range(journal.data_blocks, block, len);
+}
+
+/*
+ * Writes len bytes of a local file, starting at offset, to the image file at the contiguous blocks starting at
+ * block, which journal_block_data() marked, and zeroes the rest of the last block. Writes from src_map if the
+ * file is mapped, otherwise reads it from fd a chunk at a time. Safe to call from several threads at once
+ * Returns 0 on success or -1 if the file couldn't be read or the image written
+ */
+int journal_write_data(int fd, const unsigned char *src_map, off_t offset, unsigned int block, size_t len) {
+    off_t dest = (off_t)BLOCK_SIZE * block;
+    size_t chunk = len < (1 << 20) ? len : 1 << 20;
+    size_t tail = len % BLOCK_SIZE == 0 ? 0 : BLOCK_SIZE - len % BLOCK_SIZE;
+    unsigned char *buf = NULL;
+    if (src_map == NULL || tail != 0) {
+        buf = calloc(src_map == NULL && chunk > (size_t)BLOCK_SIZE ? chunk : BLOCK_SIZE, 1);
+        if (buf == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    int err = 0;
+    if (src_map != NULL) {
+        err = image_write(src_map + offset, len, dest);
+    } else {
+        for (size_t done = 0; done < len && err == 0; ) {
+            size_t want = len - done < chunk ? len - done : chunk;
+            ssize_t n = pread(fd, buf, want, offset + done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0 || image_write(buf, n, dest + done) == -1) err = -1;
+            else done += n;
+        }
+    }
+    if (err == 0 && tail != 0) {
+        memset(buf, 0, tail);
+        err = image_write(buf, tail, dest + len);
+    }
+    free(buf);
+    return err;
+}
+
+/*
+ * Returns an upper bound on the blocks changed through the mapping since the last commit, from the pages it has
+ * copied as /proc/self/smaps counts them, or -1 if they can't be counted
+ */
+static long journal_changed_blocks() {
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL) return -1;
+    char line[256];
+    int in_image = 0;
+    long kb = -1;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        unsigned long start, end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if (in_image) break; // The image's mapping had no Anonymous line
+            in_image = start == (uintptr_t)disk;
+        } else if (in_image && sscanf(line, "Anonymous: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(smaps);
+    return kb == -1 ? -1 : kb * 1024 / BLOCK_SIZE;
+}
+
+/*
+ * Ends one tool operation in the running transaction
+ * Returns nonzero when the transaction should be committed before the next operation starts: when the blocks it
+ * has changed, plus as many as the biggest operation so far changed, might not fit in the log. If the changed
+ * blocks can't be counted, once it holds as many operations of JOURNAL_OP_BLOCKS blocks as the log has room for
+ */
+int journal_end_op() {
+    if (!journal.active) return 0;
+    journal.ops++;
+    long changed = journal_changed_blocks();
+    if (changed == -1) return journal.ops >= journal.max_ops;
+    if (changed - journal.op_start > journal.op_blocks) journal.op_blocks = changed - journal.op_start;
+    journal.op_start = changed;
+    return changed + journal.op_blocks > journal.max_blocks;
+}
+
+// A list of block numbers
+struct journal_blocks {
+    unsigned int *blocks;
+    int count;
+    int cap;
+};
+
+static void journal_blocks_add(struct journal_blocks *list, unsigned int block) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 64;
+        list->blocks = realloc(list->blocks, list->cap * sizeof(unsigned int));
+        if (list->blocks == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    list->blocks[list->count++] = block;
+}
+
+/*
+ * Adds the blocks of the page at offset in the mapping, len bytes long, that differ from home, the page in the
+ * image, to changed, or to fresh if they were allocated in this transaction
+ */
+SPECIALIZED void journal_collect_page(size_t offset, const unsigned char *home, size_t len,
+                                      struct journal_blocks *changed, struct journal_blocks *fresh,
+                                      const int block_size) {
+    for (size_t at = 0; at + BLOCK_SIZE <= len; at += BLOCK_SIZE) {
+        unsigned int block = (offset + at) / BLOCK_SIZE;
+        // File data went straight to the image, so the mapping's copy of its page may be stale
+        if (block < sb->s_blocks_count && bitmap_test(journal.data_blocks, block)) continue;
+        if (memcmp(disk + offset + at, home + at, BLOCK_SIZE) == 0) continue;
+        if (block < sb->s_blocks_count && bitmap_test(journal.new_blocks, block)) journal_blocks_add(fresh, block);
+        else journal_blocks_add(changed, block);
+    }
+}
+
+/*
+ * Finds the blocks changed through the mapping since the last commit by comparing the pages the process has
+ * copied with the image, adding the ones allocated in this transaction to fresh and the rest to changed
+ */
+static void journal_collect(struct journal_blocks *changed, struct journal_blocks *fresh) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (image_size + page - 1) / page;
+    unsigned char *home = malloc(page);
+    if (home == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint64_t entries[512];
+    for (size_t first = 0; first < pages; first += 512) {
+        size_t n = pages - first < 512 ? pages - first : 512;
+        int known = journal.pagemap_fd != -1 &&
+                    pread(journal.pagemap_fd, entries, n * sizeof(uint64_t),
+                          ((uintptr_t)disk / page + first) * sizeof(uint64_t)) == (ssize_t)(n * sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++) {
+            // A page that has been written is no longer the file's: it is present without the file bit, or swapped
+            if (known && !((entries[i] >> 62) & 1) && !(((entries[i] >> 63) & 1) && !((entries[i] >> 61) & 1))) continue;
+            size_t offset = (first + i) * page;
+            size_t len = image_size - offset < page ? image_size - offset : page;
+            if (pread(image_fd, home, len, offset) != (ssize_t)len) {
+                perror("pread");
+                exit(1);
+            }
+            BLOCK_SIZE_SPECIALIZE(journal_collect_page, offset, home, len, changed, fresh);
+        }
+    }
+    free(home);
+}
+
+/*
+ * Empties the log once the transactions in it have been written to their place
+ */
+static void journal_checkpoint() {
+    image_sync();
+    struct journal_superblock *jsb = journal_super();
+    jsb->s_start = 0;
+    jsb->s_sequence = htonl(journal.sequence);
+    journal_write_super();
+    journal.tail = 0;
+    journal.head = journal.first;
+}
+
+/*
+ * Writes the count blocks listed in blocks to the log as one transaction, checkpointing first if the
+ * transaction doesn't fit after the ones already in the log
+ */
+static void journal_log(unsigned int *blocks, int count) {
+    struct journal_superblock *jsb = journal_super();
+    unsigned int size = journal.maxlen - journal.first;
+    unsigned int need = count + (count + JOURNAL_TAGS_PER_BLOCK - 1) / JOURNAL_TAGS_PER_BLOCK + 1;
+    if (journal.tail != 0 && (journal.head + size - journal.tail) % size + need >= size) journal_checkpoint();
+    if (journal.tail == 0) { // Start the log at this transaction
+        journal.head = journal.tail = journal.first;
+        jsb->s_start = htonl(journal.first);
+        jsb->s_sequence = htonl(journal.sequence);
+        journal_write_super();
+        journal_mark_recover(1);
+    }
+    unsigned char *buf = malloc(BLOCK_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int crc = ~0U;
+    unsigned int pos = journal.head;
+    for (int i = 0; i < count; i += JOURNAL_TAGS_PER_BLOCK) {
+        int n = count - i < JOURNAL_TAGS_PER_BLOCK ? count - i : JOURNAL_TAGS_PER_BLOCK;
+        memset(buf, 0, BLOCK_SIZE);
+        journal_header_init(buf, JBD2_DESCRIPTOR_BLOCK, journal.sequence);
+        unsigned char *p = buf + sizeof(struct journal_header);
+        for (int j = 0; j < n; j++) {
+            struct journal_tag *tag = (struct journal_tag *)p;
+            unsigned int flags = j == 0 ? 0 : JBD2_FLAG_SAME_UUID;
+            if (j == n - 1) flags |= JBD2_FLAG_LAST_TAG;
+            if (*(unsigned int *)block_ptr(blocks[i + j]) == htonl(JBD2_MAGIC)) flags |= JBD2_FLAG_ESCAPE;
+            tag->t_blocknr = htonl(blocks[i + j]);
+            tag->t_flags = htons(flags);
+            p += sizeof(struct journal_tag);
+            if (j == 0) {
+                memcpy(p, jsb->s_uuid, sizeof(jsb->s_uuid));
+                p += sizeof(jsb->s_uuid);
+            }
+        }
+        image_write_block(journal.blocks[pos], buf);
+        crc = journal_crc32(crc, buf, BLOCK_SIZE);
+        pos = journal_next(pos);
+        for (int j = 0; j < n; j++) {
+            memcpy(buf, block_ptr(blocks[i + j]), BLOCK_SIZE);
+            if (*(unsigned int *)buf == htonl(JBD2_MAGIC)) *(unsigned int *)buf = 0;
+            image_write_block(journal.blocks[pos], buf);
+            crc = journal_crc32(crc, buf, BLOCK_SIZE);
+            pos = journal_next(pos);
+        }
+    }
+    memset(buf, 0, BLOCK_SIZE);
+    journal_header_init(buf, JBD2_COMMIT_BLOCK, journal.sequence);
+    struct journal_commit_header *commit = (struct journal_commit_header *)buf;
+    commit->h_chksum_type = JBD2_CRC32_CHKSUM;
+    commit->h_chksum_size = JBD2_CRC32_CHKSUM_SIZE;
+    commit->h_chksum[0] = htonl(crc);
+    commit->h_commit_sec = htobe64(time(NULL));
+    image_write_block(journal.blocks[pos], buf);
+    free(buf);
+    journal.head = journal_next(pos);
+    journal.sequence++;
+    journal.logged = 1;
+}
+
+/*
+ * Commits the changes made since the last commit as one transaction
+ * Returns once they are durable and written to their place. Exits without writing anything if they don't fit
+ * in the log, as splitting them would let a crash leave only part of them in the image
+ */
+void journal_commit() {
+    if (!journal.active) return;
+    struct journal_blocks changed = {0};
+    struct journal_blocks fresh = {0};
+    journal_collect(&changed, &fresh);
+    if (changed.count > journal.max_blocks) {
+        fprintf(stderr, "%s: %d changed blocks don't fit in the journal, which holds %d, so nothing since the "
+                "last commit was written; give the image a bigger journal\n", image_path, changed.count, journal.max_blocks);
+        exit(1);
+    }
+    // The new blocks, file data included, must be on disk before a commit block that makes them reachable
+    image_write_blocks(fresh.blocks, fresh.count);
+    if (fresh.count > 0 || journal.data_count > 0) image_sync();
+    if (changed.count > 0) {
+        journal_log(changed.blocks, changed.count);
+        image_sync();
+        image_write_blocks(changed.blocks, changed.count);
+    }
+    free(changed.blocks);
+    free(fresh.blocks);
+    memset(journal.new_blocks, 0, (sb->s_blocks_count + 7) / 8);
+    memset(journal.freed_blocks, 0, (sb->s_blocks_count + 7) / 8);
+    memset(journal.data_blocks, 0, (sb->s_blocks_count + 7) / 8);
+    journal.data_count = 0;
+    journal.ops = 0;
+    journal.op_start = 0;
+    // Drop the copied pages, which now match the image, so the next commit only looks at new changes
+    if (mmap(disk, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, image_fd,
+             0) == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+}
+
+/*
+ * Commits the running transaction, then empties the log and clears the needs_recovery flag
+ */
+void journal_close() {
+    if (!journal.active) return;
+    journal_commit();
+    if (journal.logged) {
+        journal_checkpoint();
+        journal_mark_recover(0);
+        image_sync();
+    }
+    if (journal.pagemap_fd != -1) close(journal.pagemap_fd);
+    journal.active = 0;
+}
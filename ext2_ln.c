@@ -1,9 +1,92 @@
 #include "ext2_utils.c"
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
+/*
+ * Links to_path to from_path on the open image, with a symbolic link if symlink != 0 and a hard link otherwise
+ * Returns 0 on success or an errno value
+ */
+int ext2_ln(char *from_path, char *to_path, int symlink) {
+    struct ext2_dir_entry *from_entry = get_dir_entry_by_path(from_path, 0);
+    struct ext2_dir_entry *to_entry = get_dir_entry_by_path(to_path, 0);
+    if (!symlink) {
+        if (from_entry == NULL) return ENOENT; // Source doesn't exist
+        if (from_entry->file_type == EXT2_FT_DIR) return EISDIR; // Trying to hardlink to a directory
+    }
+    if (to_entry != NULL) return EEXIST; // Destination exists
+    struct ext2_dir_entry *parent_entry; // Entry of the directory the new entry will be put in
+    struct ext2_inode *parent_inode;
+    int parent_ino;
+    // Use the original filename if linking to a directory, otherwise the last part of to_path
+    struct dir_name *split = split_path(to_path[strlen(to_path) - 1] == '/' ? from_path : to_path);
+    if (split == NULL || split->name == NULL) {
+        if (split != NULL) free_dir_name(split);
+        return ENOENT;
+    }
+    char *dest_name = split->name;
+    parent_entry = get_dir_entry_by_path(split->parent, 1);
+    if (parent_entry == NULL) { // Destination directory doesn't exist
+        free_dir_name(split);
+        return ENOENT;
+    }
+    parent_ino = parent_entry->inode;
+    parent_inode = inode_by_index(parent_ino);
+
+    int new_inode_ind;
+    if (symlink) { // Make symlink
+        int target_len = strlen(from_path);
+        int fast = target_len < (int)sizeof(((struct ext2_inode *)0)->i_block); // Target fits in i_block
+        int err = 0;
+        if (target_len >= BLOCK_SIZE) err = ENAMETOOLONG;
+        else if (!fast && sb->s_free_blocks_count == 0) err = ENOSPC;
+        else if ((new_inode_ind = alloc_inode_index(parent_ino)) == -1) err = ENOSPC;
+        if (err != 0) {
+            free_dir_name(split);
+            return err;
+        }
+        struct ext2_inode *new_inode = inode_by_index(new_inode_ind);
+        inode_init(new_inode, EXT2_S_IFLNK);
+        new_inode->i_size = target_len;
+        new_inode->i_links_count = 1;
+        if (fast) {
+            memcpy(new_inode->i_block, from_path, target_len);
+        } else {
+            int len;
+            int new_block = alloc_data_extent(goal_block(new_inode_ind), 1, &len);
+            if (new_block == -1) {
+                new_inode->i_links_count = 0;
+                clear_inode(new_inode_ind);
+                free_dir_name(split);
+                return ENOSPC;
+            }
+            new_inode->i_blocks = DISK_SECS_PER_BLOCK;
+            new_inode->i_block[0] = new_block;
+            memcpy(block_ptr(new_block), from_path, target_len);
+        }
+    } else { // Make hardlink
+        new_inode_ind = from_entry->inode;
+    }
 
+    struct ext2_dir_entry *new_entry = add_new_entry(dest_name, parent_inode, 0);
+    free_dir_name(split);
+    if (new_entry == NULL) {
+        if (symlink) { // Free the symlink and its block again, as ext2_rm would
+            inode_by_index(new_inode_ind)->i_links_count = 0;
+            clear_inode(new_inode_ind);
+        }
+        return ENOSPC;
+    }
+    new_entry->inode = new_inode_ind;
+    if (symlink) {
+        new_entry->file_type = EXT2_FT_SYMLINK;
+    } else {
+        new_entry->file_type = from_entry->file_type;
+        inode_by_index(new_inode_ind)->i_links_count++;
+        dirty_log_inode(new_inode_ind);
+    }
+
+    return 0;
+}
+
+#ifndef EXT2_BATCH
 int main(int argc, char **argv) {
     int symlink;
     char *from_path;
@@ -22,86 +105,9 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    int fd = open(argv[1], O_RDWR);
-
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
-    }
-
-    sb = (struct ext2_super_block *) (disk + BLOCK_SIZE);
-    gd = (struct ext2_group_desc *) (disk + BLOCK_SIZE + sizeof(struct ext2_super_block));
-
-    struct ext2_dir_entry *from_entry = get_dir_entry_by_path(from_path, 0);
-    struct ext2_dir_entry *to_entry = get_dir_entry_by_path(to_path, 0);
-    if (!symlink) {
-        if (from_entry == NULL) return ENOENT; // Source doesn't exist
-        if (from_entry->file_type == EXT2_FT_DIR) return EISDIR; // Trying to hardlink to a directory
-    }
-    if (to_entry != NULL) return EEXIST; // Destination exists
-    struct ext2_dir_entry *new_entry;
-    struct ext2_dir_entry *prev_entry; // Entry the new entry will be put after
-    char *dest_name;
-    // Set dest_name and prev_entry
-    if (to_path[strlen(to_path) - 1] == '/') { // Use original filename if linking to a directory
-        struct dir_name *from_dir = split_path(from_path);
-        dest_name = from_dir->name;
-        prev_entry = get_dir_entry_by_path(from_dir->parent, 1); // Already returned if source is invalid so a higher level directory is certainly valid
-        prev_entry = last_entry(prev_entry);
-        free(from_dir->parent);
-        free(from_dir);
-    } else {
-        struct dir_name *to_dir = split_path(to_path);
-        dest_name = to_dir->name;
-        prev_entry = get_dir_entry_by_path(to_dir->parent, 1);
-        if (prev_entry == NULL) return ENOENT; // Destination directory doesn't exist
-        prev_entry = last_entry(prev_entry);
-        free(to_dir->parent);
-        free(to_dir);
-    }
-
-    int new_prev_rec = sizeof(struct ext2_dir_entry) + prev_entry->name_len + 4 - (prev_entry->name_len % 4);
-    int needed_rec = sizeof(struct ext2_dir_entry) + strlen(dest_name) + 4 - (strlen(dest_name) % 4);
-    // Handle no space for new entry
-    if (prev_entry->rec_len - new_prev_rec < needed_rec) {
-        struct ext2_inode *dir_inode = inode_by_index(prev_entry->inode);
-        if (dir_inode->i_blocks > 267) return ENOSPC;
-        int new_data_block = alloc_data_block();
-        if (new_data_block == -1) return ENOSPC;
-        dir_inode->i_block[dir_inode->i_blocks / 2 + 1] = new_data_block;
-        dir_inode->i_blocks++;
-        new_entry = (struct ext2_dir_entry *) (disk + BLOCK_SIZE * new_data_block);
-        new_entry->rec_len = 1024;
-    } else { // Just add after last entry if there's space
-        new_entry = (struct ext2_dir_entry *) (((char *) prev_entry) + new_prev_rec);
-        new_entry->rec_len = prev_entry->rec_len - new_prev_rec;
-        prev_entry->rec_len = new_prev_rec;
-    }
-
-    new_entry->name_len = strlen(dest_name);
-    memcpy(new_entry->name, dest_name, new_entry->name_len);
-
-    if (symlink) { // Make symlink
-        new_entry->file_type = EXT2_FT_SYMLINK;
-        int new_inode_ind = alloc_inode_index();
-        if (new_inode_ind == -1) return ENOSPC;
-        int new_block = alloc_data_block();
-        if (new_block == -1) return ENOSPC;
-        struct ext2_inode *new_inode = inode_by_index(new_inode_ind);
-        inode_init(new_inode, EXT2_S_IFLNK);
-        new_inode->i_size = strlen(from_path);
-        new_inode->i_links_count = 1;
-        new_inode->i_blocks = DISK_SECS_PER_BLOCK;
-        new_inode->i_block[0] = new_block;
-        memcpy(disk + BLOCK_SIZE * new_block, from_path, new_inode->i_size);
-        new_entry->inode = new_inode_ind;
-    } else { // Make hardlink
-        new_entry->file_type = EXT2_FT_REG_FILE;
-        new_entry->inode = from_entry->inode;
-        struct ext2_inode *from_inode = inode_by_index(from_entry->inode);
-        from_inode->i_links_count++;
-    }
-
-    return 0;
+    open_image(argv[1]);
+    int err = ext2_ln(from_path, to_path, symlink);
+    close_image();
+    return err;
 }
+#endif
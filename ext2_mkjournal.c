@@ -0,0 +1,104 @@
+#include "ext2_utils.c"
+
+/*
+ * Adds an ext3 journal to an image, like tune2fs -j. The other tools update an image with a journal through it,
+ * see ext2_journal.c
+ */
+
+#define JOURNAL_DEFAULT_BLOCKS 1024
+// e2fsck rejects journals shorter than this
+#define JOURNAL_MIN_BLOCKS 1024
+
+/*
+ * Copies the superblock and group descriptor table into each group that holds a backup of them, as tune2fs does
+ * when it adds a journal, so e2fsck finds the backups agree with the new features
+ */
+static void write_backup_supers() {
+    for (int group = 1; group < group_count; group++) {
+        if (!group_has_super(group)) continue;
+        unsigned char *backup = block_ptr(group_first_block(group));
+        memcpy(backup, sb, sizeof(struct ext2_super_block));
+        ((struct ext2_super_block *)backup)->s_block_group_nr = group;
+        memcpy(backup + BLOCK_SIZE, gd, (size_t)group_desc_blocks() * BLOCK_SIZE);
+    }
+}
+
+/*
+ * Undoes a journal inode that couldn't be given all its blocks: frees the blocks it maps and those of the run
+ * being mapped, from run_start + i to run_start + run_len, empties the inode and frees it if created != 0
+ */
+static void journal_inode_undo(struct ext2_inode *inode, int run_start, int i, int run_len, int created) {
+    for (; i < run_len; i++) free_data_block(run_start + i);
+    inode_truncate(inode, 0);
+    memset(inode, 0, sb->s_inode_size);
+    if (created) free_inode_index(EXT3_JOURNAL_INO);
+}
+
+/*
+ * Creates a journal of blocks blocks in inode EXT3_JOURNAL_INO, placed in one run in the middle group if it can be
+ * Returns 0 on success or an errno value
+ */
+int make_journal(int blocks) {
+    if (sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) return EEXIST;
+    struct ext2_inode *inode = inode_by_index(EXT3_JOURNAL_INO);
+    if (inode == NULL) return EINVAL;
+    if (inode->i_mode != 0 || inode->i_links_count != 0) return EBUSY; // The reserved inode is in use
+    // Leave room for the indirect blocks
+    if (blocks > (long long)sb->s_free_blocks_count - blocks / ADDRS_PER_BLOCK - 3) return ENOSPC;
+    int created = !inode_is_allocated(EXT3_JOURNAL_INO);
+    if (created) realloc_inode(EXT3_JOURNAL_INO);
+
+    memset(inode, 0, sb->s_inode_size);
+    inode_init(inode, EXT2_S_IFREG);
+    inode->i_mode |= 0600;
+    inode->i_links_count = 1;
+    inode->i_size = (unsigned int)blocks * BLOCK_SIZE;
+    inode->i_blocks = blocks * DISK_SECS_PER_BLOCK;
+    int goal = group_first_block(group_count / 2);
+    for (int b = 0; b < blocks; ) {
+        int run_len;
+        int run_start = alloc_data_extent(goal, blocks - b, &run_len);
+        if (run_start == -1) {
+            journal_inode_undo(inode, 0, 0, 0, created);
+            return ENOSPC;
+        }
+        memset(block_ptr(run_start), 0, (size_t)BLOCK_SIZE * run_len);
+        for (int i = 0; i < run_len; i++) {
+            if (inode_set_block(inode, b + i, run_start + i) == -1) { // No space for an indirect block
+                journal_inode_undo(inode, run_start, i, run_len, created);
+                return ENOSPC;
+            }
+        }
+        b += run_len;
+        goal = run_start + run_len;
+    }
+    journal_format_super(block_ptr(inode->i_block[0]), blocks);
+
+    sb->s_journal_inum = EXT3_JOURNAL_INO;
+    sb->s_journal_dev = 0;
+    memset(sb->s_journal_uuid, 0, sizeof(sb->s_journal_uuid));
+    sb->s_feature_compat |= EXT3_FEATURE_COMPAT_HAS_JOURNAL;
+    // Back up the journal inode's block map and size in the superblock, as tune2fs does, for e2fsck
+    memcpy(sb->s_jnl_blocks, inode->i_block, sizeof(inode->i_block));
+    sb->s_jnl_blocks[15] = inode->i_dir_acl;
+    sb->s_jnl_blocks[16] = inode->i_size;
+    sb->s_jnl_backup_type = EXT3_JNL_BACKUP_BLOCKS;
+    write_backup_supers();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <image file name> [journal size in blocks]\n", argv[0]);
+        exit(1);
+    }
+    int blocks = argc == 3 ? atoi(argv[2]) : JOURNAL_DEFAULT_BLOCKS;
+    if (blocks < JOURNAL_MIN_BLOCKS) {
+        fprintf(stderr, "%s: a journal needs at least %d blocks\n", argv[0], JOURNAL_MIN_BLOCKS);
+        exit(1);
+    }
+    open_image(argv[1]);
+    int err = make_journal(blocks);
+    close_image();
+    return err;
+}
@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * Work-stealing thread pool
+ * Every worker owns a deque of tasks. A worker pushes the tasks it submits onto the back of its own deque
+ * and pops from the back, so related work stays on one thread; an idle worker steals from the front of
+ * the other workers' deques. Tasks submitted from outside the pool are spread round-robin
+ */
+
+struct pool_task {
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+struct pool_deque {
+    pthread_mutex_t lock;
+    struct pool_task *tasks; // Ring buffer of cap tasks
+    int cap;
+    int head; // Index of the front task
+    int len;
+};
+
+struct task_pool {
+    int nthreads;
+    pthread_t *threads;
+    struct pool_deque *deques;
+    pthread_mutex_t lock; // Protects pending, shutdown and the condition variables below
+    pthread_cond_t work_cond; // Signalled when a task is submitted or the pool shuts down
+    pthread_cond_t done_cond; // Signalled when pending drops to 0
+    int pending; // Tasks submitted but not finished
+    int idle; // Workers waiting on work_cond
+    int shutdown;
+    int next_deque; // Deque that gets the next task submitted from outside the pool
+};
+
+static __thread int pool_worker_id = -1; // Index of the calling worker, -1 outside the pool
+
+// Appends task to the back of d
+static void deque_push(struct pool_deque *d, struct pool_task task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->len == d->cap) {
+        int cap = d->cap ? 2 * d->cap : 64;
+        struct pool_task *tasks = malloc(cap * sizeof(struct pool_task));
+        if (tasks == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < d->len; i++) tasks[i] = d->tasks[(d->head + i) % d->cap];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->cap = cap;
+        d->head = 0;
+    }
+    d->tasks[(d->head + d->len) % d->cap] = task;
+    d->len++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+// Removes a task from the back of d if back != 0, otherwise from the front. Returns 0 if d is empty
+static int deque_pop(struct pool_deque *d, int back, struct pool_task *task) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->len > 0) {
+        if (back) {
+            *task = d->tasks[(d->head + d->len - 1) % d->cap];
+        } else {
+            *task = d->tasks[d->head];
+            d->head = (d->head + 1) % d->cap;
+        }
+        d->len--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+// Takes a task from worker id's own deque, or steals one from another worker. Returns 0 if there are none
+static int pool_take(struct task_pool *pool, int id, struct pool_task *task) {
+    if (deque_pop(&pool->deques[id], 1, task)) return 1;
+    for (int i = 1; i < pool->nthreads; i++)
+        if (deque_pop(&pool->deques[(id + i) % pool->nthreads], 0, task)) return 1;
+    return 0;
+}
+
+// Runs task and signals waiters if it was the last pending task
+static void pool_run(struct task_pool *pool, struct pool_task task) {
+    task.fn(task.arg);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+struct pool_worker_arg {
+    struct task_pool *pool;
+    int id;
+};
+
+static void *pool_worker(void *varg) {
+    struct pool_worker_arg *arg = varg;
+    struct task_pool *pool = arg->pool;
+    pool_worker_id = arg->id;
+    free(arg);
+    struct pool_task task;
+    for (;;) {
+        if (pool_take(pool, pool_worker_id, &task)) {
+            pool_run(pool, task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        // Tasks may have been pushed between pool_take and taking the lock, so check again under it
+        while (!pool->shutdown && !pool_take(pool, pool_worker_id, &task)) {
+            pool->idle++;
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+            pool->idle--;
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        pool_run(pool, task);
+    }
+}
+
+/*
+ * Stops the first started workers of pool, which must have no tasks left, and frees it
+ */
+static void pool_stop(struct task_pool *pool, int started) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < started; i++) pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+/*
+ * Returns a pool of nthreads workers, or NULL if nthreads < 1 or the threads couldn't be started
+ * On failure the workers already started are stopped and everything is freed
+ */
+struct task_pool *pool_create(int nthreads) {
+    if (nthreads < 1) return NULL;
+    struct task_pool *pool = calloc(1, sizeof(struct task_pool));
+    if (pool == NULL) return NULL;
+    pool->nthreads = nthreads;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    pool->deques = calloc(nthreads, sizeof(struct pool_deque));
+    if (pool->threads == NULL || pool->deques == NULL) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (int i = 0; i < nthreads; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        struct pool_worker_arg *arg = malloc(sizeof(struct pool_worker_arg));
+        if (arg == NULL) {
+            pool_stop(pool, i);
+            return NULL;
+        }
+        arg->pool = pool;
+        arg->id = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, arg) != 0) {
+            free(arg);
+            pool_stop(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/*
+ * Queues fn(arg) to run on the pool. May be called from inside a task
+ */
+void pool_submit(struct task_pool *pool, void (*fn)(void *arg), void *arg) {
+    struct pool_task task = { fn, arg };
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    int id = pool_worker_id;
+    if (id == -1) id = pool->next_deque++ % pool->nthreads;
+    pthread_mutex_unlock(&pool->lock);
+    deque_push(&pool->deques[id], task);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle > 0) pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Waits until every submitted task, including the tasks they submit, has finished
+ */
+void pool_wait(struct task_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Waits for the pool's tasks, stops its workers and frees it
+ */
+void pool_destroy(struct task_pool *pool) {
+    pool_wait(pool);
+    pool_stop(pool, pool->nthreads);
+}
@@ -1,78 +1,262 @@
 #include "ext2_utils.c"
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
+// for_each_inode_block callback counting allocated blocks in *(int *)arg
+static void count_allocated_cb(unsigned int block, void *arg) {
+    if (block_is_allocated(block)) (*(int *)arg)++;
+}
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <image file name> <absolute path of file/link on virtual disk>\n", argv[0]);
-        exit(1);
-    }
-    int fd = open(argv[1], O_RDWR);
+// for_each_inode_block callback marking block in use
+static void realloc_block_cb(unsigned int block, void *arg) {
+    realloc_block(block);
+}
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
+/*
+ * Iterates over the deleted entries left in the gaps of a directory's blocks. A removed entry's space is
+ * folded into the rec_len of the entry before it, so the bytes after that entry's name may still hold it,
+ * and the entries removed before it
+ */
+struct deleted_iter {
+    struct block_iter blocks;
+    unsigned char *block;         // The block being walked, or NULL before the first one
+    struct ext2_dir_entry *prev;  // The entry whose rec_len covers the gap being walked
+    unsigned char *next;          // Where to look for the next deleted entry in the gap
+    unsigned char *gap_end;       // End of prev's rec_len
+    struct ext2_dir_entry *last;  // The entry returned last
+};
+
+void deleted_iter_init(struct deleted_iter *it, struct ext2_inode *dir) {
+    block_iter_init(&it->blocks, dir);
+    it->block = NULL;
+    it->prev = NULL;
+    it->next = it->gap_end = NULL;
+    it->last = NULL;
+}
+
+// Returns nonzero if entry, rec_len bytes long, could be a directory entry ending at or before end
+static int entry_fits(struct ext2_dir_entry *entry, int rec_len, unsigned char *end) {
+    return rec_len >= EXT2_DIR_REC_LEN(0) && rec_len % 4 == 0 && (unsigned char *)entry + rec_len <= end;
+}
+
+/*
+ * Sets *entry to the next deleted entry that names a valid inode and *prev to the live entry before it
+ * If the caller linked the last entry returned back in, its own gap is walked next
+ * Returns 0 once every block has been walked
+ */
+int deleted_iter_next(struct deleted_iter *it, struct ext2_dir_entry **entry, struct ext2_dir_entry **prev) {
+    if (it->last != NULL && (unsigned char *)it->prev + it->prev->rec_len == (unsigned char *)it->last)
+        it->prev = it->last; // Linked in, so the rest of the gap is the last entry's now
+    it->last = NULL;
+    while (1) {
+        // Look at every 4 byte boundary in the gap, stepping over what looks like a whole entry at once
+        while (it->next != NULL && it->next + EXT2_DIR_REC_LEN(1) <= it->gap_end) {
+            struct ext2_dir_entry *e = (struct ext2_dir_entry *)it->next;
+            if (e->name_len == 0 || !inode_is_valid(e->inode) || e->rec_len < EXT2_DIR_REC_LEN(e->name_len) ||
+                !entry_fits(e, EXT2_DIR_REC_LEN(e->name_len), it->gap_end)) {
+                it->next += 4;
+                continue;
+            }
+            it->next += EXT2_DIR_REC_LEN(e->name_len);
+            it->last = e;
+            *entry = e;
+            *prev = it->prev;
+            return 1;
+        }
+        // Move on to the next live entry in the block, or to the next block
+        unsigned char *at = it->gap_end;
+        if (it->block == NULL || at >= it->block + BLOCK_SIZE) {
+            unsigned int block;
+            do {
+                if (!block_iter_next(&it->blocks, &block)) return 0;
+            } while (block == 0 || !block_is_valid(block));
+            it->block = block_ptr(block);
+            at = it->block;
+        }
+        it->prev = (struct ext2_dir_entry *)at;
+        if (!entry_fits(it->prev, it->prev->rec_len, it->block + BLOCK_SIZE) ||
+            EXT2_DIR_REC_LEN(it->prev->name_len) > it->prev->rec_len) { // Corrupt, so give up on the block
+            it->next = NULL;
+            it->gap_end = it->block + BLOCK_SIZE;
+            continue;
+        }
+        it->next = at + EXT2_DIR_REC_LEN(it->prev->name_len);
+        it->gap_end = at + it->prev->rec_len;
     }
+}
 
-    sb = (struct ext2_super_block *) (disk + BLOCK_SIZE);
-    gd = (struct ext2_group_desc *) (disk + BLOCK_SIZE + sizeof(struct ext2_super_block));
+/*
+ * Returns 0 if deleted entry can be restored: its inode and every block it maps are free, and it isn't a
+ * directory. Otherwise returns ENOENT, or EISDIR for a directory
+ */
+static int entry_recoverable(struct ext2_dir_entry *entry) {
+    if (inode_is_allocated(entry->inode)) return ENOENT; // In use again, or still linked elsewhere
+    struct ext2_inode *inode = inode_by_index(entry->inode);
+    int type = inode->i_mode & EXT2_S_IFMT;
+    if (type == EXT2_S_IFDIR) return EISDIR; // Can't restore a directory
+    if (type != EXT2_S_IFREG && type != EXT2_S_IFLNK) return ENOENT;
+    int blocks_in_use = 0;
+    for_each_inode_block(inode, count_allocated_cb, &blocks_in_use);
+    if (blocks_in_use > 0) return ENOENT; // Some of the file's blocks have been reused since it was deleted
+    return 0;
+}
+
+/*
+ * Links deleted entry back into directory dir after prev, the live entry whose gap holds it, and marks its
+ * inode and blocks in use
+ */
+static void restore_entry(struct ext2_inode *dir, struct ext2_dir_entry *prev, struct ext2_dir_entry *entry) {
+    struct ext2_inode *inode = inode_by_index(entry->inode);
+    realloc_inode(entry->inode);
+    inode->i_links_count = 1;
+    inode->i_dtime = 0;
+    inode->i_ctime = (unsigned) time(NULL);
+    for_each_inode_block(inode, realloc_block_cb, NULL);
+    // The entry takes the rest of prev's gap, which may have grown since the entry was removed
+    unsigned char *gap_end = (unsigned char *)prev + prev->rec_len;
+    entry->rec_len = gap_end - (unsigned char *)entry;
+    prev->rec_len = (unsigned char *)entry - (unsigned char *)prev;
+    dir_index_add(dir, entry);
+}
 
-    if (get_dir_entry_by_path(argv[2], 0) != NULL) return EEXIST;
-    struct dir_name *split = split_path(argv[2]);
+/*
+ * Restores the deleted file or link path on the open image
+ * Returns 0 on success or an errno value
+ */
+int ext2_restore(char *path) {
+    if (get_dir_entry_by_path(path, 0) != NULL) return EEXIST;
+    struct dir_name *split = split_path(path);
+    if (split == NULL) return ENOENT;
     if (split->trailing_slash) return EISDIR; // Can't restore a directory
     if (split->name == NULL) return EINVAL;
     struct ext2_dir_entry *parent = get_dir_entry_by_path(split->parent, 1);
     if (parent == NULL) return ENOENT; // Directory is invalid
     struct ext2_inode *p_inode = inode_by_index(parent->inode);
-    struct ext2_dir_entry *found = NULL;
     int name_len = strlen(split->name);
-    struct ext2_dir_entry *prev; // The entry prior to the one we are restoring
-    int real_rec_len;
-    int expected_rec;
 
-    /* Find the file being restored */
-    for (int b = 0; b < p_inode->i_blocks / (2 << sb->s_log_block_size); b++) {
-        prev = (struct ext2_dir_entry *) (disk + BLOCK_SIZE * p_inode->i_block[b]);
-        int s = prev->rec_len;
-        while (s < 1024) {
-            s += prev->rec_len;
-            expected_rec = sizeof(struct ext2_dir_entry) + prev->name_len + 4 - (prev->name_len % 4);
-            real_rec_len = prev->rec_len; // Real rec_len of the entry. Will be updated as deleted entries are parsed.
-            while (expected_rec != real_rec_len) {
-                struct ext2_dir_entry *tmp = (struct ext2_dir_entry *) (((char *) prev) + expected_rec);
-                if (tmp->name_len == name_len && strncmp(split->name, tmp->name, tmp->name_len) == 0) { // Found entry to be restored
-                    found = tmp;
-                    break;
-                }
-                real_rec_len -= tmp->rec_len;
-            }
-            if (found != NULL) break;
-            prev = (struct ext2_dir_entry *) (((char *) prev) + prev->rec_len);
+    // Restore the first deleted entry by that name that can be restored
+    int err = ENOENT;
+    struct deleted_iter it;
+    struct ext2_dir_entry *entry;
+    struct ext2_dir_entry *prev;
+    deleted_iter_init(&it, p_inode);
+    while (deleted_iter_next(&it, &entry, &prev)) {
+        if (entry->name_len != name_len || memcmp(entry->name, split->name, name_len) != 0) continue;
+        err = entry_recoverable(entry);
+        if (err == 0) {
+            restore_entry(p_inode, prev, entry);
+            break;
         }
-        if (found != NULL) break;
     }
-    if (found == NULL) return ENOENT;
+    return err;
+}
 
-    /* Verify we have the data to restore the file */
-    if (found->inode == 0) return ENOENT;
-    if (inode_is_allocated(found->inode)) return ENOENT;
-    struct ext2_inode *inode = inode_by_index(found->inode);
-    for (int b = 0; b < inode->i_blocks / (2 << sb->s_log_block_size); b++) {
-        if (block_is_allocated(inode->i_block[b])) return ENOENT;
+/*
+ * Lists, or restores if restore != 0, every recoverable deleted entry in directory dir_index, at path, and in
+ * the directories under it. visited has a bit set for each directory already walked
+ * Adds the number of entries found to *count
+ */
+static void restore_scan_dir(int dir_index, char *path, int restore, unsigned char *visited, int *count) {
+    if (bitmap_test(visited, dir_index - 1)) return;
+    bitmap_set(visited, dir_index - 1);
+    struct ext2_inode *dir = inode_by_index(dir_index);
+    int path_len = strlen(path);
+    char *child = malloc(path_len + EXT2_NAME_LEN + 2);
+    if (child == NULL) {
+        perror("malloc");
+        exit(1);
     }
-    /* Actually restore the file */
-    realloc_inode(found->inode);
-    inode->i_links_count = 1;
-    inode->i_ctime = (unsigned) time(NULL);
-    // Realloc blocks
-    for (int b = 0; b < inode->i_blocks / (2 << sb->s_log_block_size); b++) {
-        realloc_block(inode->i_block[b]);
+    // This directory's deleted entries, then the directories under it
+    struct deleted_iter it;
+    struct ext2_dir_entry *entry;
+    struct ext2_dir_entry *prev;
+    deleted_iter_init(&it, dir);
+    while (deleted_iter_next(&it, &entry, &prev)) {
+        if (entry_recoverable(entry) != 0) continue;
+        if (dir_index_lookup(dir, entry->name, entry->name_len) != NULL) continue; // The name is taken again
+        sprintf(child, "%s/%.*s", path_len == 1 ? "" : path, entry->name_len, entry->name);
+        int inode_index = entry->inode;
+        if (restore) {
+            restore_entry(dir, prev, entry);
+            printf("Restored %s (inode %d)\n", child, inode_index);
+        } else {
+            printf("%s (inode %d, %u bytes)\n", child, inode_index, inode_by_index(inode_index)->i_size);
+        }
+        (*count)++;
     }
-    // Add dir entry to linked list
-    found->rec_len = prev->rec_len - expected_rec; // Update rec_len in case more files were modified in the dir since deletion
-    prev->rec_len = expected_rec;
+    struct block_iter blocks;
+    unsigned int block;
+    block_iter_init(&blocks, dir);
+    while (block_iter_next(&blocks, &block)) {
+        if (block == 0 || !block_is_valid(block)) continue;
+        int sum = 0;
+        while (sum < BLOCK_SIZE) {
+            entry = (struct ext2_dir_entry *)(block_ptr(block) + sum);
+            if (entry->rec_len == 0 || sum + entry->rec_len > BLOCK_SIZE) break;
+            sum += entry->rec_len;
+            if (entry->file_type != EXT2_FT_DIR || !inode_is_allocated(entry->inode)) continue;
+            if (entry->name[0] == '.' && (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.')))
+                continue;
+            sprintf(child, "%s/%.*s", path_len == 1 ? "" : path, entry->name_len, entry->name);
+            restore_scan_dir(entry->inode, child, restore, visited, count);
+        }
+    }
+    free(child);
+}
+
+/*
+ * Lists, or restores if restore != 0, every deleted file and link under directory path that can still be
+ * restored, walking each directory once
+ * Returns 0 on success or an errno value
+ */
+int ext2_restore_scan(char *path, int restore) {
+    struct ext2_dir_entry *entry = get_dir_entry_by_path(path, 1);
+    if (entry == NULL) return ENOENT;
+    if (entry->file_type != EXT2_FT_DIR) return ENOTDIR;
+    unsigned char *visited = calloc((sb->s_inodes_count + 7) / 8, 1);
+    if (visited == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    // Paths are printed without a trailing /, except for the root
+    char *dir_path = strdup(path);
+    if (dir_path == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    for (int len = strlen(dir_path); len > 1 && dir_path[len - 1] == '/'; len--) dir_path[len - 1] = '\0';
+    int count = 0;
+    restore_scan_dir(entry->inode, dir_path, restore, visited, &count);
+    printf(restore ? "Restored %d files\n" : "%d files can be restored\n", count);
+    free(dir_path);
+    free(visited);
     return 0;
 }
+
+#ifndef EXT2_BATCH
+int main(int argc, char **argv) {
+    int scan = 0;
+    int list = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "al")) != -1) {
+        if (opt == 'a') {
+            scan = 1;
+        } else if (opt == 'l') {
+            scan = list = 1;
+        } else {
+            fprintf(stderr, "Usage: %s <image file name> <absolute path of file/link on virtual disk>\n"
+                            "       %s -a|-l <image file name> [absolute path of a directory]\n", argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    if (scan ? optind != argc - 1 && optind != argc - 2 : optind != argc - 2) {
+        fprintf(stderr, "Usage: %s <image file name> <absolute path of file/link on virtual disk>\n"
+                        "       %s -a|-l <image file name> [absolute path of a directory]\n", argv[0], argv[0]);
+        exit(1);
+    }
+    open_image(argv[optind]);
+    int err;
+    if (scan) err = ext2_restore_scan(optind == argc - 2 ? argv[optind + 1] : "/", !list);
+    else err = ext2_restore(argv[optind + 1]);
+    close_image();
+    return err;
+}
+#endif
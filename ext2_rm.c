@@ -1,44 +1,106 @@
 #include "ext2_utils.c"
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
-
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <image file name> <absolute path on virtual disk>\n", argv[0]);
-        exit(1);
-    }
-    int fd = open(argv[1], O_RDWR);
+/*
+ * Removes the file or link path from the open image
+ * Returns 0 on success or an errno value
+ */
+int ext2_rm(char *path) {
+    struct ext2_dir_entry *entry = get_dir_entry_by_path(path, 0);
+    if (entry == NULL) return ENOENT;
+    if (entry->file_type == EXT2_FT_DIR) return EISDIR;
+    struct dir_name *name = split_path(path);
+    if (name == NULL) return ENOENT;
+    struct ext2_inode *parent = inode_by_index(get_dir_entry_by_path(name->parent, 1)->inode);
+    free(name->parent);
+    free(name->name);
+    free(name);
+    struct ext2_inode *inode = inode_by_index(entry->inode);
+    int inode_index = entry->inode;
+    remove_entry(parent, entry);
+    dirty_log_inode(inode_index);
+    inode->i_links_count--;
+    if (inode->i_links_count == 0) clear_inode(inode_index);
+    return 0;
+}
 
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("mmap");
-        exit(1);
+/*
+ * Frees directory dir_index and everything under it, deepest first, adding their blocks to batch
+ * The entries are left in the freed blocks, as ext2_rm leaves them, so ext2_restore can still find them
+ */
+static void rm_tree_free(int dir_index, struct free_batch *batch) {
+    struct ext2_inode *dir = inode_by_index(dir_index);
+    dir->i_links_count = 0; // Marks dir as being freed, so a directory linked under itself isn't entered again
+    struct block_iter it;
+    unsigned int block;
+    block_iter_init(&it, dir);
+    while (block_iter_next(&it, &block)) {
+        if (block == 0 || !block_is_valid(block)) continue;
+        int sum = 0;
+        while (sum < BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block_ptr(block) + sum);
+            if (entry->rec_len == 0 || sum + entry->rec_len > BLOCK_SIZE) break;
+            sum += entry->rec_len;
+            if (!inode_is_valid(entry->inode) || !inode_is_allocated(entry->inode)) continue;
+            if (entry->name[0] == '.' && (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.')))
+                continue;
+            struct ext2_inode *child = inode_by_index(entry->inode);
+            if ((child->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+                if (child->i_links_count != 0) rm_tree_free(entry->inode, batch);
+                continue;
+            }
+            dirty_log_inode(entry->inode);
+            if (child->i_links_count > 0) child->i_links_count--;
+            if (child->i_links_count == 0) clear_inode_batched(entry->inode, batch);
+        }
     }
+    clear_inode_batched(dir_index, batch);
+}
 
-    sb = (struct ext2_super_block *) (disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *) (disk + EXT2_BLOCK_SIZE + sizeof(struct ext2_super_block));
-
-    struct ext2_dir_entry *entry = get_dir_entry_by_path(argv[2], 0);
+/*
+ * Removes path from the open image, and if it is a directory everything under it too. The blocks of all
+ * the inodes freed are cleared from the bitmaps in one batch at the end
+ * Returns 0 on success or an errno value
+ */
+int ext2_rm_tree(char *path) {
+    struct ext2_dir_entry *entry = get_dir_entry_by_path(path, 0);
     if (entry == NULL) return ENOENT;
-    if (entry->file_type == EXT2_FT_DIR) return EISDIR;
-    // If this is the first entry in its block then make its inode 0
-    if ((unsigned long) entry % 1024 == 0) {
-        entry->inode = 0;
-    } else { // Otherwise just update previous rec_len
-        struct dir_name *name = split_path(argv[2]);
-        struct ext2_dir_entry *next = get_dir_entry_by_path(name->parent, 1);
-        struct ext2_dir_entry *c;
-        while (next != entry) {
-            c = next;
-            next = (struct ext2_dir_entry *) (((char *) next) + next->rec_len);
-        }
+    if (entry->file_type != EXT2_FT_DIR) return ext2_rm(path);
+    if (entry->inode == EXT2_ROOT_INO) return EBUSY;
+    struct dir_name *name = split_path(path);
+    if (name == NULL) return ENOENT;
+    struct ext2_inode *parent = inode_by_index(get_dir_entry_by_path(name->parent, 1)->inode);
+    free(name->parent);
+    free(name->name);
+    free(name);
+    int inode_index = entry->inode;
+    remove_entry(parent, entry);
+    parent->i_links_count--; // The directory's ..
+    dirty_log_inode(inode_index_of(parent));
+    struct free_batch batch = {0};
+    rm_tree_free(inode_index, &batch);
+    free_batch_flush(&batch);
+    return 0;
+}
 
-        c->rec_len += entry->rec_len;
+#ifndef EXT2_BATCH
+int main(int argc, char **argv) {
+    int recursive = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        if (opt == 'r') {
+            recursive = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-r] <image file name> <absolute path on virtual disk>\n", argv[0]);
+            exit(1);
+        }
     }
-    struct ext2_inode *inode = inode_by_index(entry->inode);
-    inode->i_links_count--;
-    if (inode->i_links_count == 0) clear_entry(entry);
-    return 0;
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: %s [-r] <image file name> <absolute path on virtual disk>\n", argv[0]);
+        exit(1);
+    }
+    open_image(argv[optind]);
+    int err = recursive ? ext2_rm_tree(argv[optind + 1]) : ext2_rm(argv[optind + 1]);
+    close_image();
+    return err;
 }
+#endif
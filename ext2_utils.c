@@ -1,26 +1,74 @@
+#ifndef EXT2_UTILS_C
+#define EXT2_UTILS_C
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <stdint.h>
 #include "ext2.h"
+#include "ext2_bitmap.c"
+#include "ext2_extent_tree.c"
+
+// Block size of the open image, set from its superblock by open_image
+#define BLOCK_SIZE block_size
+#define DISK_SECS_PER_BLOCK (BLOCK_SIZE / 512)
+// Number of block numbers held by an indirect block
+#define ADDRS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(unsigned int))
+
+/*
+ * Hot loops are written once as a SPECIALIZED function whose last parameter is named block_size, which hides
+ * the global, and called through BLOCK_SIZE_SPECIALIZE(fn, args...). That inlines a copy of the body for each
+ * supported block size with BLOCK_SIZE a constant, so its block size arithmetic is folded
+ */
+// Returns a pointer to block in the image mapping. The offset is computed in size_t so blocks past 4 GiB don't
+// wrap, and it is a macro so that SPECIALIZED code uses its constant block_size
+#define block_ptr(block) (disk + (size_t)BLOCK_SIZE * (unsigned int)(block))
+
+#define SPECIALIZED static inline __attribute__((always_inline))
+#define BLOCK_SIZE_SPECIALIZE(fn, ...) \
+    (block_size == 4096 ? fn(__VA_ARGS__, 4096) : block_size == 2048 ? fn(__VA_ARGS__, 2048) : fn(__VA_ARGS__, 1024))
 
-#define BLOCK_SIZE EXT2_BLOCK_SIZE
-#define DISK_SECS_PER_BLOCK 2
+unsigned char *disk;
+struct ext2_super_block *sb;
+struct ext2_group_desc *gd;
+int block_size = EXT2_BLOCK_SIZE; // 1024 << s_log_block_size of the open image
 
-extern unsigned char* disk;
-extern struct ext2_super_block *sb;
-extern struct ext2_group_desc *gd;
+char *image_path; // Path of the open image
+int image_fd = -1; // File descriptor of the open image
+int image_read_only; // Nonzero if the image was opened with open_image_read_only
+size_t image_size; // Length in bytes of the image and of its mapping
+int group_count; // Number of block groups in the group descriptor table
+struct extent_tree *free_extents; // Free block runs of each group by group offset, NULL until the first allocation
+// Allocation cursors: the group offset of the inode and of the block after the last ones allocated in each group
+int *inode_cursors;
+int *block_cursors;
+int next_block = -1; // Block after the last run allocated, where alloc_data_block starts, or -1 before any
 
 struct ext2_inode *inode_by_index(int index);
 struct ext2_dir_entry *last_entry(struct ext2_dir_entry *dir);
 int alloc_data_block();
+int alloc_data_extent(int goal, int max_len, int *len);
 int inode_is_allocated(int inode_index);
 int block_is_allocated(int block);
 void realloc_inode(int inode_index);
 void realloc_block(int block);
+void dir_index_add(struct ext2_inode *dir, struct ext2_dir_entry *entry);
+int block_is_valid(int block);
+int inode_is_valid(int inode_index);
+int inode_index_of(struct ext2_inode *inode);
+unsigned int inode_bmap(struct ext2_inode *inode, int lblk);
+struct ext2_dir_entry *dir_index_take_gap(struct ext2_inode *dir, int rec_len);
+void dir_index_append_block(struct ext2_inode *dir, unsigned int block);
+void dir_index_drop(struct ext2_inode *dir);
+
+#include "ext2_journal.c"
+#include "ext2_dirty_log.c"
 
 // Directory name entry
 struct dir_name {
@@ -29,30 +77,211 @@ struct dir_name {
     int trailing_slash; // 0 iff the last character in the entry's path was '/'
 };
 
+/*
+ * Opens the image at path, maps the whole file and sets disk, sb and gd
+ * If the image has a journal, replays it and maps the image privately, see ext2_journal.c
+ * Exits with an error message if the image can't be mapped or isn't an ext2 filesystem
+ */
+void open_image(char *path) {
+    image_path = path;
+    image_fd = open(path, image_read_only ? O_RDONLY : O_RDWR);
+    if (image_fd == -1) {
+        perror(path);
+        exit(1);
+    }
+    struct stat image_stat;
+    if (fstat(image_fd, &image_stat) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    image_size = image_stat.st_size;
+    if (image_size < EXT2_SUPER_OFFSET + sizeof(struct ext2_super_block)) {
+        fprintf(stderr, "%s: image is too small to hold a superblock\n", path);
+        exit(1);
+    }
+
+    disk = mmap(NULL, image_size, image_read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+    if (disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    sb = (struct ext2_super_block *)(disk + EXT2_SUPER_OFFSET);
+    if (sb->s_magic != EXT2_SUPER_MAGIC) {
+        fprintf(stderr, "%s: bad superblock magic number, not an ext2 filesystem\n", path);
+        exit(1);
+    }
+    if (sb->s_log_block_size > 2) {
+        fprintf(stderr, "%s: block size %u isn't supported\n", path, EXT2_BLOCK_SIZE << sb->s_log_block_size);
+        exit(1);
+    }
+    block_size = EXT2_BLOCK_SIZE << sb->s_log_block_size;
+    if ((size_t)sb->s_blocks_count * BLOCK_SIZE > image_size) {
+        fprintf(stderr, "%s: image is shorter than its %u blocks\n", path, sb->s_blocks_count);
+        exit(1);
+    }
+    if (sb->s_blocks_per_group == 0 || sb->s_inodes_per_group == 0) {
+        fprintf(stderr, "%s: superblock has no blocks or inodes per group\n", path);
+        exit(1);
+    }
+    // The group descriptor table starts in the block after the superblock's, which is block 0 with blocks over 1K
+    gd = (struct ext2_group_desc *)block_ptr(sb->s_first_data_block + 1);
+    group_count = (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+    inode_cursors = calloc(group_count, sizeof(int));
+    block_cursors = calloc(group_count, sizeof(int));
+    if (inode_cursors == NULL || block_cursors == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (!image_read_only) journal_open(path);
+    else if (sb->s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER)
+        fprintf(stderr, "%s: the journal needs replaying, so the last changes before a crash are missing\n", path);
+}
+
+/*
+ * Opens the image at path like open_image, but maps it read-only for tools that don't change it. A journal
+ * left to replay by a crash is not replayed
+ */
+void open_image_read_only(char *path) {
+    image_read_only = 1;
+    open_image(path);
+}
+
+/*
+ * Writes every change made through the mapping back to the image file, committing it through the journal if
+ * the image has one, then ends this run's dirty log and unmaps and closes the image
+ * Exits with an error message if the changes couldn't be written
+ */
+void close_image() {
+    if (image_read_only) {
+        // Nothing to write back
+    } else if (journal.active) {
+        journal_close();
+    } else if (msync(disk, image_size, MS_SYNC) == -1) {
+        perror("msync");
+        exit(1);
+    }
+    dirty_log_close();
+    munmap(disk, image_size);
+    close(image_fd);
+    disk = NULL;
+    image_fd = -1;
+}
+
+/*
+ * Returns pointer to the descriptor of block group group
+ */
+struct ext2_group_desc *group_desc(int group) {
+    return gd + group;
+}
+
+// Returns the block group holding inode inode_index
+int inode_group(int inode_index) {
+    return (inode_index - 1) / sb->s_inodes_per_group;
+}
+
+// Returns the offset of inode inode_index within its group's inode bitmap and table
+int inode_group_offset(int inode_index) {
+    return (inode_index - 1) % sb->s_inodes_per_group;
+}
+
+// Returns the block group holding block
+int block_group(int block) {
+    return (block - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+// Returns the offset of block within its group's block bitmap
+int block_group_offset(int block) {
+    return (block - sb->s_first_data_block) % sb->s_blocks_per_group;
+}
+
+// Returns the first block of group
+int group_first_block(int group) {
+    return sb->s_first_data_block + group * sb->s_blocks_per_group;
+}
+
+// Returns the number of blocks in group, which is smaller than s_blocks_per_group only for the last group
+int group_block_count(int group) {
+    int left = sb->s_blocks_count - group_first_block(group);
+    return left < sb->s_blocks_per_group ? left : sb->s_blocks_per_group;
+}
+
+// Returns 1 if n is a power of base, 0 otherwise
+static int is_power_of(int n, int base) {
+    while (n > 1 && n % base == 0) n /= base;
+    return n == 1;
+}
+
+// Returns 0 iff group holds no copy of the superblock and group descriptor table
+int group_has_super(int group) {
+    if (group <= 1 || !(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) return 1;
+    return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+// Returns the number of blocks of each copy of the group descriptor table, not counting reserved ones
+int group_desc_blocks() {
+    int per_block = BLOCK_SIZE / sizeof(struct ext2_group_desc);
+    return (group_count + per_block - 1) / per_block;
+}
+
+// Returns 0 iff inode_index isn't an inode of this filesystem
+int inode_is_valid(int inode_index) {
+    return inode_index >= 1 && inode_index <= sb->s_inodes_count;
+}
+
+// Returns 0 iff block isn't covered by any group's block bitmap
+int block_is_valid(int block) {
+    return block >= sb->s_first_data_block && block < sb->s_blocks_count;
+}
+
+// Returns pointer to the inode bitmap of group
+unsigned char *inode_bitmap(int group) {
+    return block_ptr(group_desc(group)->bg_inode_bitmap);
+}
+
+// Returns pointer to the block bitmap of group
+unsigned char *block_bitmap(int group) {
+    return block_ptr(group_desc(group)->bg_block_bitmap);
+}
+
+/*
+ * Adds delta to the free inode counters of the superblock and of inode_index's group
+ */
+void adjust_free_inodes(int inode_index, int delta) {
+    dirty_log_inode(inode_index);
+    dirty_log_group(inode_group(inode_index));
+    sb->s_free_inodes_count += delta;
+    group_desc(inode_group(inode_index))->bg_free_inodes_count += delta;
+}
+
+/*
+ * Adds delta to the free block counters of the superblock and of block's group
+ */
+void adjust_free_blocks(int block, int delta) {
+    dirty_log_group(block_group(block));
+    sb->s_free_blocks_count += delta;
+    group_desc(block_group(block))->bg_free_blocks_count += delta;
+}
+
 // Returns 0 iff the inode is 0 in the inode bitmap
 int inode_is_allocated(int inode_index) {
-    int byte_off = BLOCK_SIZE * gd->bg_inode_bitmap + (inode_index-1) / 8;
-    int bit = (inode_index - 1) % 8;
-    return ((disk[byte_off] >> bit) && 1);
+    if (!inode_is_valid(inode_index)) return 0;
+    return bitmap_test(inode_bitmap(inode_group(inode_index)), inode_group_offset(inode_index));
 }
 
 // Returns 0 iff the block is 0 in the block bitmap
 int block_is_allocated(int block) {
-        int o = BLOCK_SIZE * gd->bg_block_bitmap + (block - 1) / 8;
-        int b = (block - 1) % 8;
-        return ((disk[o] >> b) & 1);
+    if (!block_is_valid(block)) return 0;
+    return bitmap_test(block_bitmap(block_group(block)), block_group_offset(block));
 }
 
 /*
  * Allocates a specific inode in the inode bitmap
  */
 void realloc_inode(int inode_index) {
-    if (inode_index == 0) return;
-    int offset = BLOCK_SIZE * gd->bg_inode_bitmap + (inode_index - 1) / 8;
-    int bit = (inode_index - 1) / 8;
-    disk[offset] |= 256 >> (8 - bit);
-    sb->s_free_inodes_count--;
-    gd->bg_free_inodes_count--;
+    if (!inode_is_valid(inode_index)) return;
+    bitmap_set(inode_bitmap(inode_group(inode_index)), inode_group_offset(inode_index));
+    adjust_free_inodes(inode_index, -1);
 }
 
 
@@ -60,99 +289,416 @@ void realloc_inode(int inode_index) {
  * Allocates a specific block in the block bitmap
  */
 void realloc_block(int block) {
-    if (block == 0) return;
-    int offset = BLOCK_SIZE * gd->bg_block_bitmap + (block - 1) /8;
-    int bit = (block - 1) % 8;
-    disk[offset] |= 256 >> (8-bit);
-    sb->s_free_blocks_count--;
-    gd->bg_free_blocks_count--;
+    if (!block_is_valid(block)) return;
+    unsigned char *bitmap = block_bitmap(block_group(block));
+    if (free_extents != NULL && !bitmap_test(bitmap, block_group_offset(block)))
+        extent_tree_remove(&free_extents[block_group(block)], block_group_offset(block), 1);
+    bitmap_set(bitmap, block_group_offset(block));
+    adjust_free_blocks(block, -1);
 }
 
 // Zeroes the block bitmap entry for inode (1-indexed)
 void zero_inode_bitmap(int inode) {
-    int bit = (inode - 1) % 8;
-    int byte_off = BLOCK_SIZE * gd->bg_inode_bitmap + (inode-1)/8;
-    switch (8 - bit) {
-        case 1:
-            disk[byte_off] &= 127;
-            break;
-        case 2:
-            disk[byte_off] &= 191;
-            break;
-        case 3:
-            disk[byte_off] &= 223;
-            break;
-        case 4:
-            disk[byte_off] &= 239;
-            break;
-        case 5:
-            disk[byte_off] &= 247;
-            break;
-        case 6:
-            disk[byte_off] &= 251;
-            break;
-        case 7:
-            disk[byte_off] &= 253;
-            break;
-        case 8:
-            disk[byte_off] &= 254;
-    }
+    if (!inode_is_valid(inode)) return;
+    dirty_log_group(inode_group(inode));
+    bitmap_clear(inode_bitmap(inode_group(inode)), inode_group_offset(inode));
 }
 // Zeroes the block bitmap entry for block (1-indexed)
 void zero_block_bitmap(int block) {
-    int bit = (block - 1) %8;
-    int byte_off = BLOCK_SIZE * gd->bg_block_bitmap + (block-1)/8;
-    switch (8 - bit) {
-        case 1:
-            disk[byte_off] &= 127;
-            break;
-        case 2:
-            disk[byte_off] &= 191;
-            break;
-        case 3:
-            disk[byte_off] &= 223;
-            break;
-        case 4:
-            disk[byte_off] &= 239;
-            break;
-        case 5:
-            disk[byte_off] &= 247;
-            break;
-        case 6:
-            disk[byte_off] &= 251;
-            break;
-        case 7:
-            disk[byte_off] &= 253;
+    if (!block_is_valid(block)) return;
+    dirty_log_group(block_group(block));
+    unsigned char *bitmap = block_bitmap(block_group(block));
+    if (free_extents != NULL && bitmap_test(bitmap, block_group_offset(block)))
+        extent_tree_insert(&free_extents[block_group(block)], block_group_offset(block), 1);
+    bitmap_clear(bitmap, block_group_offset(block));
+    journal_block_freed(block, 1);
+}
+
+/*
+ * Frees block, as allocated by alloc_data_extent or alloc_data_block
+ */
+void free_data_block(int block) {
+    zero_block_bitmap(block);
+    adjust_free_blocks(block, 1);
+}
+/*
+ * Returns the number of logical data blocks of inode, including holes
+ */
+int inode_data_blocks(struct ext2_inode *inode) {
+    // Fast symlinks keep their target in i_block instead of a data block
+    if (inode->i_blocks == 0 && (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK) return 0;
+    unsigned long long size = inode->i_size;
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) size |= (unsigned long long)inode->i_dir_acl << 32;
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*
+ * Returns pointer to the block map slot holding the physical block of logical block lblk of inode
+ * Resolves single, double and triple indirection through i_block[EXT2_IND_BLOCK..EXT2_TIND_BLOCK]
+ * Missing indirect blocks are allocated near goal and zeroed if alloc != 0, and make this return NULL otherwise
+ * Returns NULL if lblk is past the largest file the block map can describe or an indirect block can't be allocated
+ */
+SPECIALIZED unsigned int *block_map_slot_sized(struct ext2_inode *inode, int lblk, int alloc, int goal,
+                                              const int block_size) {
+    if (lblk < 0) return NULL;
+    if (lblk < EXT2_NDIR_BLOCKS) return &inode->i_block[lblk];
+    long long rel = lblk - EXT2_NDIR_BLOCKS;
+    long long span = ADDRS_PER_BLOCK; // Number of blocks mapped through the top level indirect block
+    int depth = 1;
+    while (rel >= span) {
+        rel -= span;
+        span *= ADDRS_PER_BLOCK;
+        if (++depth > 3) return NULL;
+    }
+    unsigned int *slot = &inode->i_block[EXT2_IND_BLOCK + depth - 1];
+    for (int level = depth; level > 0; level--) {
+        span /= ADDRS_PER_BLOCK; // Number of blocks mapped through each slot of this level's table
+        if (*slot == 0 || !block_is_valid(*slot)) {
+            if (!alloc) return NULL;
+            int len;
+            int new_block = alloc_data_extent(goal, 1, &len);
+            if (new_block == -1) return NULL;
+            memset(block_ptr(new_block), 0, BLOCK_SIZE);
+            inode->i_blocks += DISK_SECS_PER_BLOCK;
+            *slot = new_block;
+        }
+        unsigned int *table = (unsigned int *)block_ptr(*slot);
+        slot = &table[rel / span];
+        rel %= span;
+    }
+    return slot;
+}
+
+unsigned int *block_map_slot(struct ext2_inode *inode, int lblk, int alloc, int goal) {
+    return BLOCK_SIZE_SPECIALIZE(block_map_slot_sized, inode, lblk, alloc, goal);
+}
+
+/*
+ * Returns the physical block holding logical block lblk of inode, or 0 if it is a hole
+ */
+unsigned int inode_bmap(struct ext2_inode *inode, int lblk) {
+    unsigned int *slot = block_map_slot(inode, lblk, 0, 0);
+    return slot == NULL ? 0 : *slot;
+}
+
+/*
+ * Maps logical block lblk of inode to block, allocating any indirect blocks needed on the way near block
+ * Indirect blocks are added to i_blocks, block itself isn't
+ * Returns 0 on success or -1 if there is no space for an indirect block
+ */
+int inode_set_block(struct ext2_inode *inode, int lblk, unsigned int block) {
+    unsigned int *slot = block_map_slot(inode, lblk, 1, block);
+    if (slot == NULL) return -1;
+    *slot = block;
+    return 0;
+}
+
+/*
+ * Returns the number of logical blocks from lblk on mapped through the same indirect block as lblk, or the
+ * direct blocks left if lblk is one. Allocating a file in such stretches, each after the indirect blocks it
+ * needs, lays the indirect blocks out just before the data they map, as the kernel does
+ */
+int block_map_stretch(int lblk) {
+    if (lblk < EXT2_NDIR_BLOCKS) return EXT2_NDIR_BLOCKS - lblk;
+    // Every indirect block of the lowest level starts EXT2_NDIR_BLOCKS past a multiple of ADDRS_PER_BLOCK
+    return ADDRS_PER_BLOCK - (lblk - EXT2_NDIR_BLOCKS) % ADDRS_PER_BLOCK;
+}
+
+/*
+ * Walks the data blocks of an inode in logical order
+ * The indirect block holding the current position is kept between calls, so a full walk
+ * resolves each indirect block once instead of once per data block
+ */
+struct block_iter {
+    struct ext2_inode *inode;
+    int next;            // Logical index of the next block to return
+    int count;           // Number of logical blocks in the inode
+    unsigned int *leaf;  // Cached indirect block mapping next, or NULL if it must be looked up
+    int leaf_index;      // Index of next within leaf
+    unsigned int peek;   // Block read past the end of the last run by block_iter_next_run
+    int has_peek;
+};
+
+void block_iter_init(struct block_iter *it, struct ext2_inode *inode) {
+    it->inode = inode;
+    it->next = 0;
+    it->count = inode_data_blocks(inode);
+    it->leaf = NULL;
+    it->leaf_index = 0;
+    it->has_peek = 0;
+}
+
+/*
+ * Sets *block to the next physical block of the walk, 0 for a hole
+ * Returns 0 once every logical block has been returned
+ */
+int block_iter_next(struct block_iter *it, unsigned int *block) {
+    if (it->next >= it->count) return 0;
+    if (it->next < EXT2_NDIR_BLOCKS) {
+        *block = it->inode->i_block[it->next++];
+        return 1;
+    }
+    if (it->leaf == NULL || it->leaf_index == ADDRS_PER_BLOCK) {
+        unsigned int *slot = block_map_slot(it->inode, it->next, 0, 0);
+        if (slot == NULL) { // The indirect block for this part of the file is missing, so it is a hole
+            it->leaf = NULL;
+            it->next++;
+            *block = 0;
+            return 1;
+        }
+        // Blocks past the direct ones start on an indirect block boundary at every level
+        it->leaf_index = (it->next - EXT2_NDIR_BLOCKS) % ADDRS_PER_BLOCK;
+        it->leaf = slot - it->leaf_index;
+    }
+    *block = it->leaf[it->leaf_index++];
+    it->next++;
+    return 1;
+}
+
+/*
+ * Sets *block and *len to the next run of physically contiguous blocks of the walk, with *block 0 for a run of holes
+ * Returns 0 once every logical block has been returned
+ * Don't mix with block_iter_next on the same walk
+ */
+int block_iter_next_run(struct block_iter *it, unsigned int *block, int *len) {
+    unsigned int first;
+    if (it->has_peek) {
+        first = it->peek;
+        it->has_peek = 0;
+    } else if (!block_iter_next(it, &first)) {
+        return 0;
+    }
+    *block = first;
+    *len = 1;
+    unsigned int next;
+    while (block_iter_next(it, &next)) {
+        if ((first == 0 && next == 0) || (first != 0 && next == first + *len)) {
+            (*len)++;
+        } else {
+            it->peek = next;
+            it->has_peek = 1;
             break;
-        case 8:
-            disk[byte_off] &= 254;
+        }
+    }
+    return 1;
+}
+
+// Calls fn on the valid blocks mapped through indirect block block at depth depth, then on block itself
+static void walk_indirect(unsigned int block, int depth, long long *remaining,
+                          void (*fn)(unsigned int, void *), void *arg) {
+    long long span = 1;
+    for (int d = 1; d < depth; d++) span *= ADDRS_PER_BLOCK;
+    if (block == 0 || !block_is_valid(block)) {
+        *remaining -= span * ADDRS_PER_BLOCK;
+        return;
+    }
+    unsigned int *table = (unsigned int *)block_ptr(block);
+    for (int i = 0; i < ADDRS_PER_BLOCK && *remaining > 0; i++) {
+        if (depth == 1) {
+            if (table[i] != 0 && block_is_valid(table[i])) fn(table[i], arg);
+            (*remaining)--;
+        } else {
+            walk_indirect(table[i], depth - 1, remaining, fn, arg);
+        }
+    }
+    fn(block, arg);
+}
+
+/*
+ * Calls fn(block, arg) for every valid block used by inode: its data blocks and the indirect blocks mapping them
+ */
+void for_each_inode_block(struct ext2_inode *inode, void (*fn)(unsigned int block, void *arg), void *arg) {
+    long long remaining = inode_data_blocks(inode);
+    for (int b = 0; b < EXT2_NDIR_BLOCKS && remaining > 0; b++, remaining--)
+        if (inode->i_block[b] != 0 && block_is_valid(inode->i_block[b])) fn(inode->i_block[b], arg);
+    for (int depth = 1; depth <= 3 && remaining > 0; depth++)
+        walk_indirect(inode->i_block[EXT2_IND_BLOCK + depth - 1], depth, &remaining, fn, arg);
+}
+
+// for_each_inode_block callback freeing block if it is allocated
+static void free_block_cb(unsigned int block, void *arg) {
+    if (!block_is_allocated(block)) return;
+    free_data_block(block);
+}
+
+/*
+ * Blocks to be freed together. free_batch_flush sorts them into runs and clears each run from its group's
+ * bitmap with bitmap_clear_range, updating the group's free counter once per group and the superblock's
+ * once per batch, instead of once per block as free_block_cb does
+ */
+struct free_batch {
+    unsigned int *blocks;
+    int count;
+    int cap;
+};
+
+// Adds block to batch if it is allocated
+void free_batch_add(struct free_batch *batch, unsigned int block) {
+    if (!block_is_allocated(block)) return;
+    if (batch->count == batch->cap) {
+        batch->cap = batch->cap ? 2 * batch->cap : 256;
+        batch->blocks = realloc(batch->blocks, batch->cap * sizeof(unsigned int));
+        if (batch->blocks == NULL) {
+            perror("realloc");
+            exit(1);
+        }
     }
+    batch->blocks[batch->count++] = block;
+}
+
+// for_each_inode_block callback adding block to the free_batch arg
+static void free_batch_cb(unsigned int block, void *arg) {
+    free_batch_add(arg, block);
+}
+
+// Adds every block of inode, including its indirect blocks, to batch
+void free_batch_add_inode(struct free_batch *batch, struct ext2_inode *inode) {
+    for_each_inode_block(inode, free_batch_cb, batch);
+}
+
+static int compare_blocks(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
 }
+
 /*
- * Zeroes the block bitmap entries for inode->block
+ * Frees the blocks in batch and empties it
+ */
+void free_batch_flush(struct free_batch *batch) {
+    if (batch->count > 0) qsort(batch->blocks, batch->count, sizeof(unsigned int), compare_blocks);
+    int freed = 0;
+    int group_freed = 0;
+    for (int i = 0; i < batch->count; ) {
+        unsigned int start = batch->blocks[i];
+        int group = block_group(start);
+        // A run ends at a gap or at the end of the group; a block added twice only counts once
+        int len = 1;
+        for (i++; i < batch->count && batch->blocks[i] <= start + len; i++) {
+            if (batch->blocks[i] == start + len && block_group(batch->blocks[i]) == group) len++;
+            else if (batch->blocks[i] != start + len - 1) break;
+        }
+        bitmap_clear_range(block_bitmap(group), block_group_offset(start), len);
+        if (free_extents != NULL) extent_tree_insert(&free_extents[group], block_group_offset(start), len);
+        journal_block_freed(start, len);
+        group_freed += len;
+        freed += len;
+        if (i == batch->count || block_group(batch->blocks[i]) != group) {
+            dirty_log_group(group);
+            group_desc(group)->bg_free_blocks_count += group_freed;
+            group_freed = 0;
+        }
+    }
+    sb->s_free_blocks_count += freed;
+    free(batch->blocks);
+    batch->blocks = NULL;
+    batch->count = batch->cap = 0;
+}
+
+/*
+ * Zeroes the block bitmap entries for every block of inode, including its indirect blocks
  */
 void clear_inode_blocks(struct ext2_inode *inode) {
-    for (int b = 0; b < inode->i_blocks / (2 << sb->s_log_block_size); b++) {
-        zero_block_bitmap(inode->i_block[b]);
-        sb->s_free_blocks_count++;
-        gd->bg_free_blocks_count++;
+    struct free_batch batch = {0};
+    free_batch_add_inode(&batch, inode);
+    free_batch_flush(&batch);
+}
+
+/*
+ * Frees what *slot maps if all of it lies at or past logical block keep, where first is the first logical block
+ * it maps and depth is 0 for a data block and 1 to 3 for an indirect block
+ */
+static void truncate_slot(struct ext2_inode *inode, unsigned int *slot, int depth, long long first, long long keep) {
+    if (*slot == 0 || !block_is_valid(*slot)) return;
+    long long span = 1;
+    for (int d = 0; d < depth; d++) span *= ADDRS_PER_BLOCK;
+    if (first + span <= keep) return;
+    if (depth > 0) {
+        unsigned int *table = (unsigned int *)block_ptr(*slot);
+        for (int i = 0; i < ADDRS_PER_BLOCK; i++)
+            truncate_slot(inode, &table[i], depth - 1, first + i * (span / ADDRS_PER_BLOCK), keep);
+    }
+    if (first >= keep) {
+        free_block_cb(*slot, NULL);
+        *slot = 0;
+        inode->i_blocks -= DISK_SECS_PER_BLOCK;
     }
 }
 
+/*
+ * Frees the blocks of inode from logical block count on, and the indirect blocks left mapping none of the
+ * rest, and cuts i_size down to count blocks if it is longer
+ */
+void inode_truncate(struct ext2_inode *inode, int count) {
+    for (int b = 0; b < EXT2_NDIR_BLOCKS; b++) truncate_slot(inode, &inode->i_block[b], 0, b, count);
+    long long first = EXT2_NDIR_BLOCKS;
+    long long span = ADDRS_PER_BLOCK;
+    for (int depth = 1; depth <= 3; depth++, first += span, span *= ADDRS_PER_BLOCK)
+        truncate_slot(inode, &inode->i_block[EXT2_IND_BLOCK + depth - 1], depth, first, count);
+    if (inode->i_size > (unsigned long long)count * BLOCK_SIZE) inode->i_size = (unsigned int)count * BLOCK_SIZE;
+}
+
+/*
+ * Copies len bytes of a local file, starting at offset, into the contiguous blocks starting at block
+ * Copies straight into the image mapping: one memcpy from src_map if the file is mapped, otherwise
+ * reads from fd with as few read calls as the kernel allows. The rest of the last block is zeroed
+ * With a journal the blocks, marked by journal_block_data, are written to the image file instead
+ * Returns 0 on success or -1 if the file couldn't be read
+ */
+int copy_to_extent(int fd, const unsigned char *src_map, off_t offset, int block, size_t len) {
+    if (journal.active) return journal_write_data(fd, src_map, offset, block, len);
+    unsigned char *dest = block_ptr(block);
+    if (src_map != NULL) {
+        memcpy(dest, src_map + offset, len);
+    } else {
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(fd, dest + done, len - done, offset + done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            done += n;
+        }
+    }
+    if (len % BLOCK_SIZE != 0) memset(dest + len, 0, BLOCK_SIZE - len % BLOCK_SIZE);
+    return 0;
+}
+
+/*
+ * Zeroes the inode bitmap for inode_index and adds its blocks to batch, which the caller frees with
+ * free_batch_flush, so that freeing many inodes updates the block bitmaps and counters once
+ */
+void clear_inode_batched(int inode_index, struct free_batch *batch) {
+    struct ext2_inode *inode = inode_by_index(inode_index);
+    free_batch_add_inode(batch, inode);
+    if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        group_desc(inode_group(inode_index))->bg_used_dirs_count--;
+        // The inode may come back as another directory, which mustn't find this one's index
+        dir_index_drop(inode);
+    }
+    inode->i_dtime = (unsigned)time(NULL);
+    zero_inode_bitmap(inode_index);
+    adjust_free_inodes(inode_index, 1);
+}
+
+/*
+ * Zeroes the block and inode bitmaps for the blocks of inode inode_index and for inode_index itself
+ */
+void clear_inode(int inode_index) {
+    struct free_batch batch = {0};
+    clear_inode_batched(inode_index, &batch);
+    free_batch_flush(&batch);
+}
+
 /*
  * Zeroes the block and inode bitmaps for dir->inode->block and dir->inode
  * Doesn't actually remove the entry
  */
 void clear_entry(struct ext2_dir_entry *dir) {
-    struct ext2_inode *inode = inode_by_index(dir->inode);
-    clear_inode_blocks(inode);
-    inode->i_dtime = (unsigned)time(NULL);
-    zero_inode_bitmap(dir->inode);
-    sb->s_free_inodes_count++;
-    gd->bg_free_inodes_count++;
+    clear_inode(dir->inode);
 }
 /*
- * Adds a new entry to the directory pointed to by inode
+ * Adds a new entry to the directory pointed to by inode, in the first gap big enough for it in any of its
+ * blocks (see dir_index_take_gap), or in a new block at its end if there is none
  * Precondition is_first_entry != 0 iff the new entry will be the first entry in the block
  * Returns pointer to new entry or NULL if entry couldn't be created
  *** SET inode AND file_type AFTER CALLING ***
@@ -160,34 +706,35 @@ void clear_entry(struct ext2_dir_entry *dir) {
 struct ext2_dir_entry *add_new_entry(char *entry_name, struct ext2_inode *inode, int is_first_entry) {
     struct ext2_dir_entry *new_dir = NULL;
     int name_len = strlen(entry_name);
-    int last_new_rec;
-    int i_block_max_ind = inode->i_blocks / DISK_SECS_PER_BLOCK - 1;
-    struct ext2_dir_entry *last;
-    last = (struct ext2_dir_entry *)(disk + BLOCK_SIZE * inode->i_block[i_block_max_ind]);
+    int block_count = inode_data_blocks(inode);
     if (is_first_entry) {
-        new_dir = last;
-        new_dir->rec_len = 1024;
+        new_dir = (struct ext2_dir_entry *)block_ptr(inode_bmap(inode, block_count - 1));
+        new_dir->rec_len = BLOCK_SIZE;
     }
     else {
-        last = last_entry(last);
-        last_new_rec = sizeof(struct ext2_dir_entry) + last->name_len + 4 - (last->name_len % 4);
+        // The entry won't be in the directory's hashed index, so drop the index as a kernel without htree would
+        inode->i_flags &= ~EXT2_INDEX_FL;
+        new_dir = dir_index_take_gap(inode, EXT2_DIR_REC_LEN(name_len));
         // If there's no space for the new entry then get another data block and add the entry to it
-        if (last->rec_len - last_new_rec < sizeof(struct ext2_dir_entry) + name_len + 4 - (name_len % 4)) {
-            int new_block = alloc_data_block();
+        if (new_dir == NULL) {
+            int len;
+            int new_block = alloc_data_extent(inode_bmap(inode, block_count - 1), 1, &len);
             if (new_block == -1) return NULL;
+            if (inode_set_block(inode, block_count, new_block) == -1) { // No space for an indirect block
+                free_data_block(new_block);
+                return NULL;
+            }
             inode->i_blocks += DISK_SECS_PER_BLOCK;
-            inode->i_block[i_block_max_ind + 1] = new_block;
-            new_dir = (struct ext2_dir_entry *)(disk + BLOCK_SIZE * new_block);
-            new_dir->rec_len = 1024;
-        }
-        else {
-            new_dir = (struct ext2_dir_entry *)(((char *)last) + last_new_rec);
-            new_dir->rec_len = last->rec_len - last_new_rec; // This %4 = 0 since rec_len and last_new_rec %4 = 0
-            last->rec_len = last_new_rec;
+            inode->i_size += BLOCK_SIZE;
+            new_dir = (struct ext2_dir_entry *)block_ptr(new_block);
+            memset(new_dir, 0, BLOCK_SIZE); // The block may hold a deleted file's data
+            new_dir->rec_len = BLOCK_SIZE;
+            dir_index_append_block(inode, new_block);
         }
     }
     new_dir->name_len = name_len;
     memcpy(new_dir->name, entry_name, name_len); // Copy name without null terminator
+    dir_index_add(inode, new_dir);
     return new_dir;
 }
 
@@ -233,6 +780,7 @@ struct dir_name *split_path(char *full_path) {
     }
     char *name = strrchr(path, '/');
     if (name == NULL) {
+        free(ret);
         free(path);
         return NULL; // If there are no / the path is invalid
     }
@@ -261,14 +809,23 @@ struct dir_name *split_path(char *full_path) {
     ret->parent = parent;
     ret->name = malloc(strlen(name) + 1);
     strcpy(ret->name, name);
+    if (ret->trailing_slash) free(name); // name was copied out of path above
     free(path);
     return ret;
 }
+
+// Frees split, as returned by split_path, and its members
+void free_dir_name(struct dir_name *split) {
+    free(split->name);
+    free(split->parent);
+    free(split);
+}
 /*
  * Initialize inode with i_mode of mode
  * i_links_count is set to 0
  */
 void inode_init(struct ext2_inode *inode, unsigned short mode) {
+    memset(inode, 0, sizeof(struct ext2_inode)); // Don't inherit a block map from a deleted inode
     inode->i_mode = mode;
     inode->i_ctime = (unsigned)time(NULL);
 }
@@ -278,56 +835,450 @@ void inode_init(struct ext2_inode *inode, unsigned short mode) {
  */
 struct ext2_inode* inode_by_index(int index) {
 	if (index < 1 || index > sb->s_inodes_count) return NULL;
-	return (struct ext2_inode *)(disk + (BLOCK_SIZE * gd->bg_inode_table + sb->s_inode_size * (index - 1)));
+	return (struct ext2_inode *)(block_ptr(group_desc(inode_group(index))->bg_inode_table) +
+	                             (size_t)sb->s_inode_size * inode_group_offset(index));
+}
+
+/*
+ * Returns the index of the inode inode points to in the mapped inode tables, or -1 if it isn't in one
+ * Inode tables are laid out in group order, so its group is found by binary search, with a scan of every group
+ * for images where they aren't
+ */
+int inode_index_of(struct ext2_inode *inode) {
+    size_t offset = (unsigned char *)inode - disk;
+    size_t table_size = (size_t)sb->s_inodes_per_group * sb->s_inode_size;
+    int lo = 0, hi = group_count - 1; // Last group whose table starts at or before offset
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if ((size_t)(block_ptr(group_desc(mid)->bg_inode_table) - disk) <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    for (int i = -1; i < group_count; i++) {
+        int group = i == -1 ? lo : i;
+        size_t table = block_ptr(group_desc(group)->bg_inode_table) - disk;
+        if (offset >= table && offset < table + table_size)
+            return group * sb->s_inodes_per_group + (offset - table) / sb->s_inode_size + 1;
+    }
+    return -1;
 }
 
 /*
+ * Allocates an inode near directory dir_inode: the first free one from the cursor of dir_inode's group,
+ * wrapping around the group, then in the groups after it. Each group's cursor moves past the inode it
+ * hands out, so a run of allocations scans each bitmap once instead of from its start every time
  * Returns index of allocated inode or -1 if there are no inodes left
- */ 
-int alloc_inode_index() {
+ */
+int alloc_inode_index(int dir_inode) {
     if (sb->s_free_inodes_count == 0) return -1;
-    for (int byte = 0; byte < sb->s_inodes_count / 8; byte++) {
-        for (int bit = 0; bit < 8; bit++) {
-            int node_no = bit + 8*byte + 1;
-            if (node_no <= EXT2_GOOD_OLD_FIRST_INO) continue; // Skip reserved inodes
-            int byte_off = BLOCK_SIZE * gd->bg_inode_bitmap + byte;
-            if (!((disk[byte_off] >> bit) & 1)) {
-				disk[byte_off] |= 256 >> (8 - bit);
-                sb->s_free_inodes_count--;
-                gd->bg_free_inodes_count--;
-                return node_no;
-            }
-        }
+    int goal_group = inode_is_valid(dir_inode) ? inode_group(dir_inode) : 0;
+    for (int i = 0; i < group_count; i++) {
+        int group = (goal_group + i) % group_count;
+        if (group_desc(group)->bg_free_inodes_count == 0) continue;
+        unsigned char *bitmap = inode_bitmap(group);
+        // Skip reserved inodes, which all live in group 0
+        int first = group == 0 ? EXT2_GOOD_OLD_FIRST_INO - 1 : 0;
+        int cursor = inode_cursors[group] > first ? inode_cursors[group] : first;
+        int offset = bitmap_find_zero(bitmap, cursor, sb->s_inodes_per_group);
+        if (offset == -1) offset = bitmap_find_zero(bitmap, first, cursor);
+        if (offset == -1) continue;
+        int node_no = group * sb->s_inodes_per_group + offset + 1;
+        bitmap_set(bitmap, offset);
+        adjust_free_inodes(node_no, -1);
+        inode_cursors[group] = (offset + 1) % sb->s_inodes_per_group;
+        return node_no;
     }
     return -1;
 }
 
 /*
- * Returns pointer to allocated inode or NULL if there are no inodes left
+ * Frees inode_index, as allocated by alloc_inode_index, without touching the inode itself
+ */
+void free_inode_index(int inode_index) {
+    zero_inode_bitmap(inode_index);
+    adjust_free_inodes(inode_index, 1);
+}
+
+/*
+ * Returns pointer to an inode allocated near directory dir_inode or NULL if there are no inodes left
  */
-struct ext2_inode* alloc_inode() {
-	int index = alloc_inode_index();
+struct ext2_inode* alloc_inode(int dir_inode) {
+	int index = alloc_inode_index(dir_inode);
 	return inode_by_index(index);
 }
 
+/*
+ * Returns the block allocations for inode_index should start searching from: the block after the last run
+ * allocated in its group. This keeps an inode's data near its inode table entry, like ext2's goal block,
+ * and lays out the files of a group one after another
+ */
+int goal_block(int inode_index) {
+    if (!inode_is_valid(inode_index)) return sb->s_first_data_block;
+    int group = inode_group(inode_index);
+    return group_first_block(group) + block_cursors[group];
+}
+
+/*
+ * Builds free_extents from the block bitmaps, one tree of free runs per group
+ * realloc_block, zero_block_bitmap and alloc_data_extent keep it in step with the bitmaps from then on
+ */
+static void free_extents_build() {
+    free_extents = malloc(group_count * sizeof(struct extent_tree));
+    if (free_extents == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int group = 0; group < group_count; group++) {
+        extent_tree_init(&free_extents[group]);
+        unsigned char *bitmap = block_bitmap(group);
+        int nbits = group_block_count(group);
+        for (int start = bitmap_find_zero(bitmap, 0, nbits); start != -1; ) {
+            int len = bitmap_run_length(bitmap, start, nbits);
+            extent_tree_insert(&free_extents[group], start, len);
+            start = start + len < nbits ? bitmap_find_zero(bitmap, start + len, nbits) : -1;
+        }
+    }
+}
+
+/*
+ * Allocates a run of up to max_len contiguous free blocks, searching from goal onwards and wrapping around
+ * Takes the first run from goal that can hold all max_len blocks; if there is none, takes the longest free run
+ * Sets *len to the length of the run. Runs never cross a group boundary
+ * Each group is checked in O(log n) through its free-extent tree
+ * Returns the first block of the run or -1 if there are no free blocks
+ */
+int alloc_data_extent(int goal, int max_len, int *len) {
+    if (sb->s_free_blocks_count == 0 || max_len < 1) return -1;
+    if (free_extents == NULL) free_extents_build();
+    if (!block_is_valid(goal)) goal = sb->s_first_data_block;
+    int goal_group = block_group(goal);
+    int found_group = -1;
+    int start = 0, run_len = 0;
+    // Visit goal_group a second time at the end to search the part of it before the goal
+    for (int i = 0; i <= group_count && found_group == -1; i++) {
+        int group = (goal_group + i) % group_count;
+        int from = i == 0 ? block_group_offset(goal) : 0;
+        if (extent_tree_next_fit(&free_extents[group], from, max_len, &start, &run_len)) found_group = group;
+    }
+    if (found_group == -1) { // No run is long enough, so take the longest one
+        int longest = 0;
+        for (int group = 0; group < group_count; group++) {
+            if (extent_tree_max(&free_extents[group]) > longest) {
+                longest = extent_tree_max(&free_extents[group]);
+                found_group = group;
+            }
+        }
+        if (found_group == -1) return -1;
+        extent_tree_longest(&free_extents[found_group], &start, &run_len);
+    }
+    *len = run_len < max_len ? run_len : max_len;
+    extent_tree_remove(&free_extents[found_group], start, *len);
+    bitmap_set_range(block_bitmap(found_group), start, *len);
+    int block = group_first_block(found_group) + start;
+    sb->s_free_blocks_count -= *len;
+    group_desc(found_group)->bg_free_blocks_count -= *len;
+    block_cursors[found_group] = (start + *len) % group_block_count(found_group);
+    next_block = block + *len;
+    journal_block_allocated(block, *len);
+    dirty_log_group(found_group);
+    return block;
+}
+
 /*
  * Returns the index of the allocated data block or -1 if there are no free blocks
+ * Carries on from the last allocation, so blocks allocated one at a time end up next to each other
  */
 int alloc_data_block() {
-    if (sb->s_free_blocks_count == 0) return -1;
-    unsigned int byte_off;
-    for (int byte = 0; byte < sb->s_blocks_count / 8; byte++) {
-        for (int bit = 0; bit < 8; bit++) {
-            byte_off = BLOCK_SIZE * gd->bg_block_bitmap + byte;
-            if (((disk[byte_off] >> bit) & 1) == 0) { // If block isn't allocated
-                disk[byte_off] |= 256 >> (8-bit); // Mark block allocated in bitmap
-                sb->s_free_blocks_count--;
-                gd->bg_free_blocks_count--;
-                return byte*8 + bit + 1;
-            }   
+    int len;
+    return alloc_data_extent(next_block == -1 ? sb->s_first_data_block : next_block, 1, &len);
+}
+
+/*
+ * In-memory hashed directory index
+ * The first lookup in a directory walks all of its entries once and builds an open-addressing hash table
+ * of them keyed by name; later lookups in that directory within the process take O(1). Indexes are cached
+ * per directory inode and kept current by add_new_entry, dir_index_add and dir_index_remove
+ * Each index also keeps the directory's blocks with a bound on the largest gap a new entry could take in each,
+ * so add_new_entry only walks the blocks that may have room. Removing an entry raises its block's bound
+ * and a walk that finds less room than the bound lowers it
+ */
+#define DIR_INDEX_TOMBSTONE ((struct ext2_dir_entry *)1) // Marks a removed slot so probing continues past it
+
+struct dir_index {
+    struct ext2_inode *dir;          // Directory this indexes
+    struct ext2_dir_entry **slots;   // Entries, NULL for an empty slot
+    unsigned int *hashes;            // Name hash of each slot's entry
+    int cap;                         // Number of slots, a power of 2
+    int used;                        // Slots holding an entry or a tombstone
+    unsigned int *blocks;            // The directory's blocks in logical order, holes left out
+    unsigned short *slack;           // At least the largest gap in bytes a new entry could take in each block
+    int nblocks;
+    int blocks_cap;
+};
+
+struct dir_index **dir_indexes; // Cache of built indexes, open addressing keyed by directory inode
+int dir_index_cap;
+int dir_index_count;
+
+// FNV-1a hash of a name
+static unsigned int name_hash(const char *name, int name_len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < name_len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Returns the cache slot for dir, which is empty if dir has no index
+static struct dir_index **dir_index_cache_slot(struct ext2_inode *dir) {
+    unsigned int i = (unsigned int)(((uintptr_t)dir / sizeof(struct ext2_inode)) * 2654435761u) & (dir_index_cap - 1);
+    while (dir_indexes[i] != NULL && dir_indexes[i]->dir != dir) i = (i + 1) & (dir_index_cap - 1);
+    return &dir_indexes[i];
+}
+
+// Inserts entry with name hash h into index without checking for duplicates
+static void dir_index_insert(struct dir_index *index, struct ext2_dir_entry *entry, unsigned int h);
+
+// Doubles the slots of index if inserting one more entry would make it more than half full
+static void dir_index_grow(struct dir_index *index) {
+    if (2 * (index->used + 1) <= index->cap) return;
+    struct ext2_dir_entry **old_slots = index->slots;
+    unsigned int *old_hashes = index->hashes;
+    int old_cap = index->cap;
+    index->cap = old_cap ? 2 * old_cap : 16;
+    index->slots = calloc(index->cap, sizeof(struct ext2_dir_entry *));
+    index->hashes = malloc(index->cap * sizeof(unsigned int));
+    if (index->slots == NULL || index->hashes == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    index->used = 0;
+    for (int i = 0; i < old_cap; i++)
+        if (old_slots[i] != NULL && old_slots[i] != DIR_INDEX_TOMBSTONE) dir_index_insert(index, old_slots[i], old_hashes[i]);
+    free(old_slots);
+    free(old_hashes);
+}
+
+static void dir_index_insert(struct dir_index *index, struct ext2_dir_entry *entry, unsigned int h) {
+    dir_index_grow(index);
+    unsigned int i = h & (index->cap - 1);
+    while (index->slots[i] != NULL && index->slots[i] != DIR_INDEX_TOMBSTONE) i = (i + 1) & (index->cap - 1);
+    if (index->slots[i] == NULL) index->used++;
+    index->slots[i] = entry;
+    index->hashes[i] = h;
+}
+
+// Returns the bytes a new entry could take from entry: all of it if it is unused, otherwise what its name leaves
+static inline int dir_entry_gap(struct ext2_dir_entry *entry) {
+    return entry->inode == 0 ? entry->rec_len : entry->rec_len - EXT2_DIR_REC_LEN(entry->name_len);
+}
+
+// Adds block, whose largest gap is at most slack bytes, to the end of index's blocks
+static void dir_index_note_block(struct dir_index *index, unsigned int block, int slack) {
+    if (index->nblocks == index->blocks_cap) {
+        index->blocks_cap = index->blocks_cap ? 2 * index->blocks_cap : 8;
+        index->blocks = realloc(index->blocks, index->blocks_cap * sizeof(unsigned int));
+        index->slack = realloc(index->slack, index->blocks_cap * sizeof(unsigned short));
+        if (index->blocks == NULL || index->slack == NULL) {
+            perror("realloc");
+            exit(1);
         }
     }
-    return -1;
+    index->blocks[index->nblocks] = block;
+    index->slack[index->nblocks++] = slack;
+}
+
+// Adds the entries in use of directory block block to index, and the block with its largest gap
+SPECIALIZED void dir_index_add_block(struct dir_index *index, unsigned int block, const int block_size) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block_ptr(block);
+    int sum = 0;
+    int slack = 0;
+    while (sum < BLOCK_SIZE && entry->rec_len != 0) {
+        if (entry->inode != 0) dir_index_insert(index, entry, name_hash(entry->name, entry->name_len));
+        if (dir_entry_gap(entry) > slack) slack = dir_entry_gap(entry);
+        sum += entry->rec_len;
+        entry = (struct ext2_dir_entry *)(((char *)entry) + entry->rec_len);
+    }
+    dir_index_note_block(index, block, slack);
+}
+
+/*
+ * Returns the largest gap in directory block block, setting *fit to its first entry with a gap of at least
+ * need bytes, or to NULL if it has none
+ */
+SPECIALIZED int dir_block_gap(unsigned int block, int need, struct ext2_dir_entry **fit, const int block_size) {
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block_ptr(block);
+    int sum = 0;
+    int slack = 0;
+    *fit = NULL;
+    while (sum < BLOCK_SIZE && entry->rec_len != 0) {
+        int gap = dir_entry_gap(entry);
+        if (gap > slack) slack = gap;
+        if (*fit == NULL && gap >= need) *fit = entry;
+        sum += entry->rec_len;
+        entry = (struct ext2_dir_entry *)(((char *)entry) + entry->rec_len);
+    }
+    return slack;
+}
+
+/*
+ * Returns the index of directory dir, building and caching it if this is the first lookup in dir
+ */
+struct dir_index *dir_index_get(struct ext2_inode *dir) {
+    if (2 * (dir_index_count + 1) > dir_index_cap) { // Keep the cache at most half full
+        struct dir_index **old = dir_indexes;
+        int old_cap = dir_index_cap;
+        dir_index_cap = old_cap ? 2 * old_cap : 64;
+        dir_indexes = calloc(dir_index_cap, sizeof(struct dir_index *));
+        if (dir_indexes == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (int i = 0; i < old_cap; i++)
+            if (old[i] != NULL) *dir_index_cache_slot(old[i]->dir) = old[i];
+        free(old);
+    }
+    struct dir_index **slot = dir_index_cache_slot(dir);
+    if (*slot != NULL) return *slot;
+
+    struct dir_index *index = calloc(1, sizeof(struct dir_index));
+    if (index == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    index->dir = dir;
+    struct block_iter it;
+    unsigned int block;
+    block_iter_init(&it, dir);
+    while (block_iter_next(&it, &block)) {
+        if (block_is_valid(block)) BLOCK_SIZE_SPECIALIZE(dir_index_add_block, index, block);
+    }
+    *slot = index;
+    dir_index_count++;
+    return index;
+}
+
+/*
+ * Returns the entry named name (name_len bytes, not necessarily null terminated) in directory dir, or NULL
+ */
+struct ext2_dir_entry *dir_index_lookup(struct ext2_inode *dir, const char *name, int name_len) {
+    struct dir_index *index = dir_index_get(dir);
+    if (index->cap == 0) return NULL;
+    unsigned int h = name_hash(name, name_len);
+    for (unsigned int i = h & (index->cap - 1); index->slots[i] != NULL; i = (i + 1) & (index->cap - 1)) {
+        struct ext2_dir_entry *entry = index->slots[i];
+        if (entry == DIR_INDEX_TOMBSTONE || index->hashes[i] != h) continue;
+        // Skip entries whose inode has been cleared since they were indexed
+        if (entry->inode != 0 && entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0) return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Finds the first gap of at least rec_len bytes in the blocks of directory dir and makes an entry of it, either
+ * an unused entry or the space split off the end of the entry it follows
+ * Returns the entry, with its rec_len set, or NULL if no block has room
+ */
+struct ext2_dir_entry *dir_index_take_gap(struct ext2_inode *dir, int rec_len) {
+    struct dir_index *index = dir_index_get(dir);
+    for (int i = 0; i < index->nblocks; i++) {
+        if (index->slack[i] < rec_len) continue;
+        struct ext2_dir_entry *fit;
+        index->slack[i] = BLOCK_SIZE_SPECIALIZE(dir_block_gap, index->blocks[i], rec_len, &fit);
+        if (fit == NULL) continue; // The bound was stale
+        if (fit->inode == 0) return fit;
+        int used = EXT2_DIR_REC_LEN(fit->name_len);
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)((char *)fit + used);
+        entry->rec_len = fit->rec_len - used;
+        fit->rec_len = used;
+        return entry;
+    }
+    return NULL;
+}
+
+// Adds block, just added to the end of directory dir and holding one unused entry, to dir's index
+void dir_index_append_block(struct ext2_inode *dir, unsigned int block) {
+    if (dir_index_cap == 0) return;
+    struct dir_index *index = *dir_index_cache_slot(dir);
+    if (index != NULL) dir_index_note_block(index, block, BLOCK_SIZE);
+}
+
+/*
+ * Adds entry, which must already have its name, to dir's index if dir has been indexed
+ * Every new entry passes through here, so this also logs the change to dir
+ */
+void dir_index_add(struct ext2_inode *dir, struct ext2_dir_entry *entry) {
+    dirty_log_dir(dir);
+    if (dir_index_cap == 0) return;
+    struct dir_index *index = *dir_index_cache_slot(dir);
+    if (index != NULL) dir_index_insert(index, entry, name_hash(entry->name, entry->name_len));
+}
+
+/*
+ * Removes entry from dir's index if dir has been indexed, and logs the change to dir
+ */
+void dir_index_remove(struct ext2_inode *dir, struct ext2_dir_entry *entry) {
+    dirty_log_dir(dir);
+    if (dir_index_cap == 0) return;
+    struct dir_index *index = *dir_index_cache_slot(dir);
+    if (index == NULL || index->cap == 0) return;
+    // The entry's space goes to a neighbour or stays as an unused entry, so its block may have a bigger gap
+    unsigned int block = ((unsigned char *)entry - disk) / BLOCK_SIZE;
+    for (int i = 0; i < index->nblocks; i++)
+        if (index->blocks[i] == block) index->slack[i] = BLOCK_SIZE;
+    unsigned int h = name_hash(entry->name, entry->name_len);
+    for (unsigned int i = h & (index->cap - 1); index->slots[i] != NULL; i = (i + 1) & (index->cap - 1)) {
+        if (index->slots[i] == entry) {
+            index->slots[i] = DIR_INDEX_TOMBSTONE;
+            return;
+        }
+    }
+}
+
+/*
+ * Re-reads dir's entries into its index if dir has been indexed, after its blocks were rewritten, and logs
+ * the change to dir
+ */
+void dir_index_rebuild(struct ext2_inode *dir) {
+    dirty_log_dir(dir);
+    if (dir_index_cap == 0) return;
+    struct dir_index *index = *dir_index_cache_slot(dir);
+    if (index == NULL) return;
+    if (index->cap > 0) {
+        memset(index->slots, 0, index->cap * sizeof(struct ext2_dir_entry *));
+        index->used = 0;
+    }
+    index->nblocks = 0;
+    struct block_iter it;
+    unsigned int block;
+    block_iter_init(&it, dir);
+    while (block_iter_next(&it, &block)) {
+        if (block_is_valid(block)) BLOCK_SIZE_SPECIALIZE(dir_index_add_block, index, block);
+    }
+}
+
+/*
+ * Frees dir's index if dir has been indexed, once dir is freed
+ */
+void dir_index_drop(struct ext2_inode *dir) {
+    if (dir_index_cap == 0) return;
+    struct dir_index **slot = dir_index_cache_slot(dir);
+    struct dir_index *index = *slot;
+    if (index == NULL) return;
+    *slot = NULL;
+    dir_index_count--;
+    // Move the indexes probed past the freed slot back so their lookups don't stop at it
+    int mask = dir_index_cap - 1;
+    for (int i = (slot - dir_indexes + 1) & mask; dir_indexes[i] != NULL; i = (i + 1) & mask) {
+        struct dir_index *moved = dir_indexes[i];
+        dir_indexes[i] = NULL;
+        *dir_index_cache_slot(moved->dir) = moved;
+    }
+    free(index->slots);
+    free(index->hashes);
+    free(index->blocks);
+    free(index->slack);
+    free(index);
 }
 
 /*
@@ -335,49 +1286,124 @@ int alloc_data_block() {
  * Precondition path is a syntactically valid path
  */
 struct ext2_dir_entry* get_dir_entry_by_path(char *path, int enter_final_dir) {
-    struct ext2_inode *inode = (struct ext2_inode *)(disk + BLOCK_SIZE * gd->bg_inode_table + sb->s_inode_size * (EXT2_ROOT_INO - 1)); 
+    struct ext2_inode *inode = inode_by_index(EXT2_ROOT_INO);
     if (strlen(path) == 1) {
         if (strcmp(path, "/") == 0) {
-            return (struct ext2_dir_entry *)(disk + BLOCK_SIZE * inode->i_block[0]);
+            return (struct ext2_dir_entry *)block_ptr(inode->i_block[0]);
         }
         else return NULL;
     }
     char *copy = malloc(strlen(path) + 1);
     strcpy(copy, path);
-    char *str = strtok(copy, "/");
-    int found = 0;
-    struct ext2_dir_entry *dir = (struct ext2_dir_entry *)(disk + BLOCK_SIZE * inode->i_block[0]);
-    char dir_buf[EXT2_NAME_LEN + 1];
-    int sum;
+    char *save;
+    char *str = strtok_r(copy, "/", &save);
+    struct ext2_dir_entry *dir = (struct ext2_dir_entry *)block_ptr(inode->i_block[0]);
     while (str != NULL) {
-        char *next_str = strtok(NULL, "/");
-        found = 0;
-        for (int i = 0; i < inode->i_blocks / (2 << sb->s_log_block_size); i++) {
-            if (inode->i_block[i] == 0) break; // sanity check
-            dir = (struct ext2_dir_entry *)(disk + BLOCK_SIZE * inode->i_block[i]);
-            sum = 0;
-            //if (next_str != NULL && dir->file_type != EXT2_FT_DIR) continue;
-            while (sum < BLOCK_SIZE) {
-                memcpy(dir_buf, dir->name, dir->name_len);
-                memcpy(dir_buf + dir->name_len, "\0", 1);
-                if (strncmp(str, dir_buf, strlen(str)) == 0) {
-                    inode = (struct ext2_inode *)(disk + BLOCK_SIZE * gd->bg_inode_table + sb->s_inode_size * (dir->inode-1));
-                    found = 1;
-                    break;
-                }
-                sum += dir->rec_len;
-                dir = (struct ext2_dir_entry *)(((char *)dir) + dir->rec_len);
-            }
-            if (found) break;
+        // Only directories can have more components after them
+        if (inode == NULL || (inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+            free(copy);
+            return NULL;
         }
-        if (!found){ //&& next_str != NULL) {
+        dir = dir_index_lookup(inode, str, strlen(str));
+        if (dir == NULL) {
             free(copy);
             return NULL;
         }
-        str = next_str;
+        inode = inode_by_index(dir->inode);
+        str = strtok_r(NULL, "/", &save);
     }
     // Get first entry in the directory if final entry in path is a directory
-    if (enter_final_dir && dir->file_type == EXT2_FT_DIR) dir = (struct ext2_dir_entry *)(disk + BLOCK_SIZE * inode->i_block[0]);
+    if (enter_final_dir && dir->file_type == EXT2_FT_DIR && inode != NULL) dir = (struct ext2_dir_entry *)block_ptr(inode->i_block[0]);
     free(copy);
     return dir;
 }
+
+/*
+ * Takes entry out of directory parent, folding its space into the entry before it
+ */
+void remove_entry(struct ext2_inode *parent, struct ext2_dir_entry *entry) {
+    dir_index_remove(parent, entry);
+    // If this is the first entry in its block then make its inode 0
+    size_t block_off = ((unsigned char *) entry - disk) % BLOCK_SIZE;
+    if (block_off == 0) {
+        entry->inode = 0;
+    } else { // Otherwise just update previous rec_len
+        struct ext2_dir_entry *next = (struct ext2_dir_entry *) ((unsigned char *) entry - block_off);
+        struct ext2_dir_entry *c;
+        while (next != entry) {
+            c = next;
+            next = (struct ext2_dir_entry *) (((char *) next) + next->rec_len);
+        }
+
+        c->rec_len += entry->rec_len;
+    }
+}
+
+/*
+ * Creates the directory full_path on the open image
+ * Returns 0 on success or an errno value
+ */
+int make_dir(char *full_path) {
+    struct ext2_dir_entry *dir;
+    // Check if directory exists
+    dir = get_dir_entry_by_path(full_path, 0);
+    if (dir != NULL) return EEXIST;
+    if (strlen(full_path) == 1) {
+        if (strcmp(full_path, "/") == 0) return EEXIST;
+        return ENOENT;
+    }
+    struct dir_name *split = split_path(full_path);
+    if (split == NULL) return ENOENT;
+    if (strlen(split->name) > EXT2_NAME_LEN) {
+        free_dir_name(split);
+        return ENAMETOOLONG;
+    }
+    dir = get_dir_entry_by_path(split->parent, 1);
+    if (dir == NULL || dir->file_type != EXT2_FT_DIR) {
+        free_dir_name(split);
+        return ENOENT;
+    }
+    int new_inode_ind = alloc_inode_index(dir->inode);
+    if (new_inode_ind == -1) {
+        free_dir_name(split);
+        return ENOSPC;
+    }
+    int len;
+    int data_block = alloc_data_extent(goal_block(new_inode_ind), 1, &len);
+    if (data_block == -1) {
+        free_inode_index(new_inode_ind);
+        free_dir_name(split);
+        return ENOSPC;
+    }
+    memset(block_ptr(data_block), 0, BLOCK_SIZE); // The block may hold a deleted file's data
+    struct ext2_inode *inode = inode_by_index(dir->inode);
+    struct ext2_dir_entry *new_dir = add_new_entry(split->name, inode, 0);
+    free_dir_name(split);
+    if (new_dir == NULL) { // Undo the allocations above, last first
+        free_data_block(data_block);
+        free_inode_index(new_inode_ind);
+        return ENOSPC;
+    }
+    new_dir->file_type = EXT2_FT_DIR;
+    struct ext2_inode *new_inode = inode_by_index(new_inode_ind);
+    inode_init(new_inode, EXT2_S_IFDIR);
+    new_inode->i_mode = EXT2_S_IFDIR;
+    new_inode->i_links_count = 2; // link from parent and .
+    new_inode->i_blocks = DISK_SECS_PER_BLOCK;
+    new_inode->i_block[0] = data_block;
+    new_inode->i_size = BLOCK_SIZE;
+    new_dir->inode = new_inode_ind;
+    group_desc(inode_group(new_inode_ind))->bg_used_dirs_count++;
+    // Make entry for .
+    struct ext2_dir_entry *dot = add_new_entry(".", new_inode, 1);
+    dot->inode = new_inode_ind;
+    dot->file_type = EXT2_FT_DIR;
+    // Make entry for ..
+    struct ext2_dir_entry *dotdot = add_new_entry("..", new_inode, 0);
+    dotdot->inode = dir->inode; // Set inode to parent's inode
+    dotdot->file_type = EXT2_FT_DIR;
+    inode_by_index(dir->inode)->i_links_count++; // dir->inode is valid or we wouldn't have gotten here
+    return 0;
+}
+
+#endif
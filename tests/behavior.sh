@@ -0,0 +1,269 @@
+#!/bin/sh
+# Runs the tools against small scratch images, each changed or corrupted for one case, and checks the result
+# with e2fsck or by exporting and comparing. Needs mke2fs, e2fsck and debugfs from e2fsprogs.
+# Usage: tests/behavior.sh [tool directory]
+set -e
+BIN=$(cd "${1:-.}" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# Makes a fresh t.img with 1 KiB blocks, of the size given in KiB
+new_image() {
+    rm -f t.img t.img.dirty
+    mke2fs -q -F -t ext2 -b 1024 t.img "${1:-8192}" > /dev/null 2>&1
+}
+
+# Fails with e2fsck's report unless t.img is clean
+fsck_clean() {
+    e2fsck -fn t.img > fsck.out 2>&1 || { cat fsck.out; fail "$1"; }
+}
+
+# Prints the free blocks counter of group $1 of t.img
+free_blocks() {
+    debugfs -R show_super_stats t.img 2> /dev/null | awk -v g="$1:" '$1 == "Group" && $2 == g { getline; print $1 }'
+}
+
+# Prints the free block and inode counts of t.img
+free_counts() {
+    dumpe2fs -h t.img 2> /dev/null | grep -E '^Free (blocks|inodes):'
+}
+
+# Runs the debugfs requests read from stdin against t.img, to set up or corrupt it
+corrupt() {
+    debugfs -w -f - t.img > /dev/null 2>&1
+}
+
+# Runs ext2_checker on t.img, which must then be clean, and fails unless its report has the line given
+check_fixes() {
+    "$BIN/ext2_checker" t.img > checker.out || { cat checker.out; fail "$1"; }
+    grep -qF "$2" checker.out || { cat checker.out; fail "$1: no \"$2\""; }
+    fsck_clean "$1"
+}
+
+# Inodes no entry names are reattached under /lost+found, a directory with its .. pointing there, or freed if
+# they were deleted; link counts are set to the entries found
+new_image
+echo hello > a
+corrupt <<EOF
+write a f
+mkdir d
+write a d/x
+unlink d
+write a g
+unlink g
+write a h
+unlink h
+sif <16> links_count 0
+sif f links_count 5
+EOF
+check_fixes "unattached directory" "Fixed: unattached inode [13] reattached to /lost+found"
+grep -qF "Fixed: unattached inode [15] reattached to /lost+found" checker.out || { cat checker.out; fail "unattached file"; }
+grep -qF "Fixed: unattached deleted inode [16] freed" checker.out || { cat checker.out; fail "unattached deleted file"; }
+grep -qF "link count was 5, should be 1" checker.out || { cat checker.out; fail "link count"; }
+"$BIN/ext2_export" t.img "/lost+found/#13/x" out
+cmp a out || fail "unattached directory"
+rm out
+"$BIN/ext2_export" t.img "/lost+found/#15" out
+cmp a out || fail "unattached file"
+rm out
+
+# An unattached inode whose block the bitmap shows as free keeps it when /lost+found is made for it
+new_image
+echo hello > a
+corrupt <<EOF
+rmdir lost+found
+write a f
+write a g
+unlink g
+EOF
+echo "freeb $(debugfs -R "blocks <12>" t.img 2> /dev/null)" | corrupt
+check_fixes "lost+found made over an unmarked block" "Fixed: unattached inode [12] reattached to /lost+found"
+"$BIN/ext2_export" t.img "/lost+found/#12" out
+cmp a out || fail "lost+found made over an unmarked block"
+rm out
+
+# A copied file's indirect blocks go just before the data they map, so it is one contiguous run
+new_image
+head -c 3000000 /dev/urandom > data
+"$BIN/ext2_cp" t.img data /data
+fsck_clean "ext2_cp layout"
+grep -qF "(0.0% non-contiguous)" fsck.out || { cat fsck.out; fail "ext2_cp layout: file isn't contiguous"; }
+"$BIN/ext2_export" t.img /data out
+cmp data out || fail "ext2_cp layout"
+rm out
+
+# Batch commands unescape their arguments, and a failed command is reported with its line while the rest still run
+new_image
+echo spaced > "local file"
+cat > cmds <<'EOF'
+# A comment, then a blank line
+
+mkdir /a\ dir
+cp local\ file /a\ dir/back\\slash
+mkdir /a\ dir
+frobnicate /x
+ln -s /a\ dir /a\ dir /extra
+mkdir /after
+EOF
+status=0
+"$BIN/ext2_batch" t.img cmds 2> batch.err || status=$?
+[ "$status" -eq 17 ] || fail "batch exit status $status, not the first failure's EEXIST"
+printf '%s\n' "line 5: mkdir: File exists" "line 6: invalid command" "line 7: invalid command" > batch.expected
+cmp batch.err batch.expected || { cat batch.err; fail "batch error report"; }
+fsck_clean "batch"
+"$BIN/ext2_export" t.img '/a dir/back\slash' out
+cmp "local file" out || fail "batch escaping"
+rm out
+"$BIN/ext2_export" -r t.img /after out || fail "batch stopped at a failed command"
+rm -r out
+
+# A transaction committed to the journal but not yet written in place is replayed when the image is opened, and
+# one whose logged copy was torn fails its checksum and is dropped
+new_image
+"$BIN/ext2_mkjournal" t.img 1024
+echo hello > a
+echo "write a f" | corrupt
+BLOCK=$(debugfs -R "blocks /f" t.img 2> /dev/null | tr -d ' ')
+head -c 1024 /dev/urandom > logged
+printf 'jo\njw -b %s logged\njc\n' "$BLOCK" | corrupt
+cp t.img logged.img
+"$BIN/ext2_mkdir" t.img /d 2> replay.out
+grep -qF "replayed 1 journal transactions" replay.out || { cat replay.out; fail "journal replay"; }
+dd if=t.img bs=1024 skip="$BLOCK" count=1 2> /dev/null | cmp - logged || fail "journal replay"
+fsck_clean "journal replay"
+mv logged.img t.img
+# The log starts with the transaction's descriptor block, followed by its copy of the block
+dd if=/dev/zero of=t.img bs=1024 seek="$(debugfs -R "bmap <8> 2" t.img 2> /dev/null)" count=1 conv=notrunc 2> /dev/null
+"$BIN/ext2_mkdir" t.img /d 2> replay.out
+[ ! -s replay.out ] || { cat replay.out; fail "torn journal commit"; }
+dd if=t.img bs=1024 skip="$BLOCK" count=1 2> /dev/null | head -c 6 | cmp - a || fail "torn journal commit"
+fsck_clean "torn journal commit"
+
+# The incremental check only checks the groups in the dirty log, which it then removes, and checks everything
+# when the log is incomplete
+new_image 32768
+"$BIN/ext2_mkdir" t.img /d
+LOGGED=$(awk '$1 == "group" { print $2; exit }' t.img.dirty)
+for g in 0 1 2 3; do grep -qx "group $g" t.img.dirty || UNLOGGED=$g; done
+printf 'set_bg %s free_blocks_count %s\nset_bg %s free_blocks_count %s\n' \
+    "$LOGGED" $(($(free_blocks "$LOGGED") - 5)) "$UNLOGGED" $(($(free_blocks "$UNLOGGED") - 7)) | corrupt
+"$BIN/ext2_checker" --incremental t.img > checker.out
+grep -qF "Fixed block group's free blocks counter was off by 5" checker.out || { cat checker.out; fail "incremental check"; }
+grep -qF "off by 7" checker.out && { cat checker.out; fail "incremental check of an unlogged group"; }
+[ ! -e t.img.dirty ] || fail "incremental check left the dirty log"
+"$BIN/ext2_mkdir" t.img /e
+printf 'begin\ngroup 0\n' >> t.img.dirty # A run that didn't finish
+"$BIN/ext2_checker" --incremental t.img > checker.out
+grep -qF "The dirty log is incomplete, checking the whole image" checker.out || { cat checker.out; fail "incomplete dirty log"; }
+grep -qF "Fixed block group's free blocks counter was off by 7" checker.out || { cat checker.out; fail "incomplete dirty log"; }
+fsck_clean "incomplete dirty log"
+
+# A block two files claim is copied for the higher inode, and blocks marked in use that nothing owns are freed
+new_image
+echo hello > a
+echo world > b
+corrupt <<EOF
+write a f
+write b g
+EOF
+printf 'sif g block[0] %s\nsetb 5000 3\n' "$(debugfs -R "blocks /f" t.img 2> /dev/null)" | corrupt
+check_fixes "cross-linked blocks" "Fixed: inode [13] got its own copy of 1 cross-linked blocks"
+grep -qF "Fixed: 4 blocks marked in use in group 0 without an owner freed" checker.out || {
+    cat checker.out; fail "unowned blocks"; }
+for f in f g; do
+    "$BIN/ext2_export" t.img /$f out
+    cmp a out || fail "cross-linked blocks"
+    rm out
+done
+
+# ext2_compact -s sorts a directory's entries by name, unless sorted they would need more blocks than the directory
+# has: /d's entries fill its two blocks exactly in their current order, but sorted they need three
+new_image
+long() {
+    printf "%s%0$2d" "$1" 0
+}
+{
+    echo "mkdir /d"
+    for name in $(long l1 253) $(long l2 253) $(long l3 253) $(long m1 198) $(long l4 253) $(long l5 253) \
+                $(long l6 253) $(long m2 198) $(long s 15); do
+        echo "ln -s /x /d/$name"
+    done
+    echo "mkdir /e"
+    for name in c a b; do echo "ln -s /x /e/$name"; done
+} > cmds
+"$BIN/ext2_batch" t.img cmds
+debugfs -R "ls -p /d" t.img 2> /dev/null | sort > before
+"$BIN/ext2_compact" -s t.img > /dev/null || fail "ext2_compact -s"
+fsck_clean "ext2_compact -s"
+debugfs -R "ls -p /d" t.img 2> /dev/null | sort > after
+cmp before after || fail "ext2_compact -s of entries that don't fit sorted"
+debugfs -R "stat /d" t.img 2> /dev/null | grep -q "Size: 2048$" || fail "ext2_compact -s grew /d"
+[ "$(debugfs -R "ls /e" t.img 2> /dev/null | tr -s ' ' '\n' | grep '^[abc]$' | tr -d '\n')" = abc ] ||
+    fail "ext2_compact -s didn't sort /e"
+
+# ext2_rm -r frees a whole tree, keeping a file that is still linked from outside it, and won't remove /
+new_image
+mkdir -p tree/sub/deep
+head -c 3000000 /dev/urandom > tree/big
+echo kept > tree/sub/kept
+echo deep > tree/sub/deep/file
+free_counts > before
+"$BIN/ext2_cp" -r t.img tree /tree
+"$BIN/ext2_ln" t.img /tree/sub/kept /kept
+"$BIN/ext2_rm" -r t.img /tree || fail "ext2_rm -r"
+fsck_clean "ext2_rm -r"
+"$BIN/ext2_export" t.img /kept out
+cmp tree/sub/kept out || fail "ext2_rm -r of a file linked outside the tree"
+rm out
+"$BIN/ext2_rm" t.img /kept
+free_counts > after
+cmp before after || { cat before after; fail "ext2_rm -r left blocks or inodes in use"; }
+status=0
+"$BIN/ext2_rm" -r t.img / 2> /dev/null || status=$?
+[ "$status" -eq 16 ] || fail "ext2_rm -r / exited with $status, not EBUSY"
+fsck_clean "ext2_rm -r /"
+
+# ext2_restore -l lists the deleted files that can be restored without changing the image, and -a restores them;
+# a file whose inode was taken again can't be
+new_image
+echo first > a
+echo second > c
+"$BIN/ext2_mkdir" t.img /d
+"$BIN/ext2_cp" t.img a /a
+"$BIN/ext2_cp" t.img c /d/c
+"$BIN/ext2_cp" t.img c /e
+"$BIN/ext2_rm" t.img /e
+"$BIN/ext2_cp" t.img a /n
+"$BIN/ext2_rm" t.img /a
+"$BIN/ext2_rm" t.img /d/c
+cp t.img listed.img
+"$BIN/ext2_restore" -l t.img > restore.out
+printf '%s\n' "/a (inode 13, 6 bytes)" "/d/c (inode 14, 7 bytes)" "2 files can be restored" | cmp - restore.out ||
+    { cat restore.out; fail "ext2_restore -l"; }
+cmp t.img listed.img || fail "ext2_restore -l changed the image"
+"$BIN/ext2_restore" -a t.img > restore.out
+grep -qx "Restored 2 files" restore.out || { cat restore.out; fail "ext2_restore -a"; }
+fsck_clean "ext2_restore -a"
+for f in a d/c; do
+    "$BIN/ext2_export" t.img /$f out
+    cmp $(basename $f) out || fail "ext2_restore -a of /$f"
+    rm out
+done
+
+# A batch whose commands together change more blocks than the journal holds commits between them
+new_image 65536
+"$BIN/ext2_mkjournal" t.img 1024
+mkdir src
+for i in $(seq 1 300); do echo "$i" > src/f$i; done
+for i in $(seq 1 20); do echo "cp -r src /d$i"; done > cmds
+for i in $(seq 1 20); do echo "rm -r /d$i"; done >> cmds
+"$BIN/ext2_batch" t.img < cmds || fail "journaled batch bigger than the journal"
+fsck_clean "journaled batch bigger than the journal"
+
+echo "behavior: ok"
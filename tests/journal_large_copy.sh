@@ -0,0 +1,28 @@
+#!/bin/sh
+# Copies a file bigger than the machine's memory into a journaled image, whose file data must not be held in
+# memory until the commit, and checks the result with e2fsck. Needs mke2fs and e2fsck from e2fsprogs and free
+# disk space for two copies of the file. Usage: tests/journal_large_copy.sh [tool directory]
+set -e
+BIN=$(cd "${1:-.}" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+MEM_MB=$(awk '/^MemTotal:/ { print int($2 / 1024) }' /proc/meminfo)
+SIZE_MB=$((MEM_MB + 1024))
+FREE_MB=$(df -Pk . | awk 'NR == 2 { print int($4 / 1024) }')
+if [ "$FREE_MB" -lt $((SIZE_MB * 2 + 1024)) ]; then
+    echo "journal large copy: skipped, needs $((SIZE_MB * 2 + 1024)) MiB free for a $SIZE_MB MiB file"
+    exit 0
+fi
+
+mke2fs -q -F -t ext2 -b 4096 t.img $((SIZE_MB + 1024))M
+"$BIN/ext2_mkjournal" t.img
+truncate -s ${SIZE_MB}M big
+printf head | dd of=big conv=notrunc 2> /dev/null
+printf tail | dd of=big bs=1 seek=$((SIZE_MB * 1024 * 1024 - 4)) conv=notrunc 2> /dev/null
+"$BIN/ext2_cp" t.img big /big || { echo "FAIL: ext2_cp of a file bigger than memory"; exit 1; }
+e2fsck -fn t.img > fsck.out 2>&1 || { cat fsck.out; echo "FAIL: ext2_cp of a file bigger than memory"; exit 1; }
+"$BIN/ext2_export" t.img /big out
+cmp big out
+echo "journal large copy: ok"
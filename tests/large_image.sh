@@ -0,0 +1,38 @@
+#!/bin/sh
+# Runs the tools against a sparse 8 GiB image with 4 KiB blocks, whose upper groups lie past 4 GiB, and checks
+# the result with e2fsck. Needs mke2fs and e2fsck from e2fsprogs. Usage: tests/large_image.sh [tool directory]
+set -e
+BIN=$(cd "${1:-.}" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+fsck() {
+    e2fsck -fn t.img > fsck.out 2>&1 || { cat fsck.out; echo "FAIL: $1"; exit 1; }
+}
+
+mke2fs -q -F -t ext2 -b 4096 t.img 8G
+head -c 3000000 /dev/urandom > data
+# The journal goes in the middle group, past 4 GiB
+"$BIN/ext2_mkjournal" t.img
+fsck "ext2_mkjournal"
+# With a journal every change is committed through blocks past 4 GiB
+"$BIN/ext2_mkdir" t.img /d
+"$BIN/ext2_cp" t.img data /d/data
+"$BIN/ext2_ln" t.img -s /d/data /d/sym
+fsck "changes through the journal"
+"$BIN/ext2_export" t.img /d/data out
+cmp data out
+# A file of 4 GiB or more keeps the high bits of its size in i_dir_acl
+truncate -s 4500M huge
+printf head | dd of=huge conv=notrunc 2> /dev/null
+printf tail | dd of=huge bs=1 seek=$((4500 * 1024 * 1024 - 4)) conv=notrunc 2> /dev/null
+"$BIN/ext2_cp" t.img huge /huge
+fsck "ext2_cp of a file over 4 GiB"
+rm -f out
+"$BIN/ext2_export" t.img /huge out
+cmp huge out
+rm out
+"$BIN/ext2_checker" t.img > checker.out
+grep -q "No file system inconsistencies detected" checker.out || { cat checker.out; echo "FAIL: ext2_checker"; exit 1; }
+echo "large image: ok"